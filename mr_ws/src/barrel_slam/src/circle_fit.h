@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <cmath>
+#include <cstddef>
+
+/**
+ * @brief Алгебраическая аппроксимация окружности по точкам (метод Таубина)
+ *
+ * Окружность ищется как минимум алгебраического расстояния x^2 + y^2 + D x + E y + F
+ * с нормировкой Таубина: в отличие от метода Касы, оценка центра почти не смещена
+ * к точкам, когда они покрывают короткую дугу, как видимая дальномеру сторона маяка.
+ * Решение - наименьший корень характеристического многочлена 3-й степени методом Ньютона
+ * из нуля, всего один проход по точкам и O(1) действий после него.
+ */
+namespace circle_fit {
+
+struct Circle
+{
+  Eigen::Vector2d center;
+  double radius;
+};
+
+// Окружность по count точкам (x[i], y[i]), false - если точки лежат на прямой или их меньше трех
+inline bool fit(const float* x, const float* y, std::size_t count, Circle& circle)
+{
+  if (count < 3) {
+    return false;
+  }
+  double mean_x = 0, mean_y = 0;
+  for (std::size_t i = 0; i < count; ++i) {
+    mean_x += x[i];
+    mean_y += y[i];
+  }
+  mean_x /= count;
+  mean_y /= count;
+
+  // моменты точек относительно центра масс, z = x^2 + y^2
+  double Mxx = 0, Myy = 0, Mxy = 0, Mxz = 0, Myz = 0, Mzz = 0;
+  for (std::size_t i = 0; i < count; ++i) {
+    const double xi = x[i] - mean_x;
+    const double yi = y[i] - mean_y;
+    const double zi = xi * xi + yi * yi;
+    Mxx += xi * xi;
+    Myy += yi * yi;
+    Mxy += xi * yi;
+    Mxz += xi * zi;
+    Myz += yi * zi;
+    Mzz += zi * zi;
+  }
+  Mxx /= count;
+  Myy /= count;
+  Mxy /= count;
+  Mxz /= count;
+  Myz /= count;
+  Mzz /= count;
+
+  // коэффициенты характеристического многочлена
+  const double Mz = Mxx + Myy;
+  const double cov_xy = Mxx * Myy - Mxy * Mxy;
+  const double var_z = Mzz - Mz * Mz;
+  const double A3 = 4 * Mz;
+  const double A2 = -3 * Mz * Mz - Mzz;
+  const double A1 = var_z * Mz + 4 * cov_xy * Mz - Mxz * Mxz - Myz * Myz;
+  const double A0 = Mxz * (Mxz * Myy - Myz * Mxy) + Myz * (Myz * Mxx - Mxz * Mxy) - var_z * cov_xy;
+
+  // Ньютон от нуля монотонно сходится к наименьшему корню
+  double root = 0;
+  double value = A0;
+  for (int iteration = 0; iteration < 20; ++iteration) {
+    const double derivative = A1 + root * (2 * A2 + 3 * A3 * root);
+    const double next = root - value / derivative;
+    if (next == root || !std::isfinite(next)) {
+      break;
+    }
+    const double next_value = A0 + next * (A1 + next * (A2 + next * A3));
+    if (std::abs(next_value) >= std::abs(value)) {
+      break;
+    }
+    root = next;
+    value = next_value;
+  }
+
+  const double det = root * root - root * Mz + cov_xy;
+  if (!(std::abs(det) > 1e-12 * Mz * Mz)) {
+    return false;
+  }
+  const double center_x = (Mxz * (Myy - root) - Myz * Mxy) / det / 2;
+  const double center_y = (Myz * (Mxx - root) - Mxz * Mxy) / det / 2;
+  circle.center << center_x + mean_x, center_y + mean_y;
+  circle.radius = std::sqrt(center_x * center_x + center_y * center_y + Mz);
+  return std::isfinite(circle.radius);
+}
+
+}  // namespace circle_fit
@@ -0,0 +1,293 @@
+#include "fastslam.h"
+#include <Eigen/Cholesky>
+#include <Eigen/LU>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+namespace {
+
+double normalize_angle(double a)
+{
+  return std::atan2(std::sin(a), std::cos(a));
+}
+
+// Прогноз измерения маяка landmark из положения pose и якобианы по положению и маяку
+void observation_model(const Eigen::Vector3d& pose, const Eigen::Vector2d& landmark, Eigen::Vector2d& measurement,
+                       Eigen::Matrix<double, 2, 3>& Hx, Eigen::Matrix2d& Hm)
+{
+  const double dx = landmark(0) - pose(0);
+  const double dy = landmark(1) - pose(1);
+  const double dist2 = dx * dx + dy * dy;
+  const double dist = std::sqrt(dist2);
+  measurement << dist, normalize_angle(std::atan2(dy, dx) - pose(2));
+  Hx << -dx / dist, -dy / dist, 0,
+        dy / dist2, -dx / dist2, -1;
+  Hm << dx / dist, dy / dist,
+        -dy / dist2, dx / dist2;
+}
+
+// Логарифм плотности нормального распределения невязки с квадратом расстояния Махаланобиса distance
+double log_likelihood(double distance, const Eigen::Matrix2d& covariance)
+{
+  return -0.5 * (distance + std::log((2 * M_PI * covariance).determinant()));
+}
+
+}
+
+FastSlam::FastSlam(std::size_t particles, std::size_t threads, const Eigen::Matrix3d& R, const Eigen::Matrix2d& Q,
+                   double association_gate, double new_landmark_gate, unsigned seed) :
+    R_(R),
+    Q_(Q),
+    association_gate_(association_gate),
+    new_landmark_gate_(new_landmark_gate),
+    particles_(std::max<std::size_t>(particles, 1)),
+    pool_(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())),
+    rng_(seed)
+{
+  for (auto& particle : particles_) {
+    particle.pose.setZero();
+    particle.log_weight = 0;
+    particle.rng.seed(rng_());
+  }
+}
+
+double FastSlam::propose(std::size_t index, Eigen::Vector3d& mu, Eigen::Matrix3d& Sigma, int* associations,
+                         double* nearest) const
+{
+  const Particle& particle = particles_[index];
+  const auto& measurements = *measurements_;
+  const std::size_t m = measurements.size();
+
+  // прогноз положения по перемещению, как в Slam::predict
+  mu = predicted_[index];
+  Sigma = R_;
+
+  // предложение FastSLAM 2.0: распределение положения последовательно уточняется
+  // по каждому ассоциированному измерению скана
+  double log_weight = 0;
+  Eigen::Vector2d measurement_pred;
+  Eigen::Matrix<double, 2, 3> Hx, best_Hx;
+  Eigen::Matrix2d Hm, best_Hm, best_L;
+  Eigen::Vector2d best_innovation;
+  for (std::size_t i = 0; i < m; ++i) {
+    associations[i] = -1;
+    if (!new_landmark_.empty() && new_landmark_[i]) {
+      continue;
+    }
+    int best = -1;
+    nearest[i] = std::numeric_limits<double>::infinity();
+    for (int n : (*candidates_)[i]) {
+      // маяк, уже сопоставленный измерению этого скана, второе измерение не получает
+      if (std::find(associations, associations + i, n) != associations + i) {
+        continue;
+      }
+      const LandmarkEstimate& landmark = particle.landmarks.get(n);
+      observation_model(mu, landmark.mean, measurement_pred, Hx, Hm);
+      Eigen::Vector2d innovation = measurements[i] - measurement_pred;
+      innovation(1) = normalize_angle(innovation(1));
+      const Eigen::Matrix2d L = Hx * Sigma * Hx.transpose() + Hm * landmark.covariance * Hm.transpose() + Q_;
+      const double distance = innovation.dot(L.ldlt().solve(innovation));
+      if (distance < nearest[i]) {
+        nearest[i] = distance;
+        best = n;
+        best_Hx = Hx;
+        best_Hm = Hm;
+        best_L = L;
+        best_innovation = innovation;
+      }
+    }
+    if (best < 0) {
+      continue;
+    }
+    if (nearest[i] >= association_gate_) {
+      // измерение без пары в этой частице правдоподобно не больше, чем на пороге ассоциации
+      log_weight += log_likelihood(association_gate_, best_L);
+      continue;
+    }
+    associations[i] = best;
+    log_weight += log_likelihood(nearest[i], best_L);
+    const Eigen::Matrix2d Qn_inv =
+        (Q_ + best_Hm * particle.landmarks.get(best).covariance * best_Hm.transpose()).inverse();
+    Sigma = (best_Hx.transpose() * Qn_inv * best_Hx + Sigma.inverse()).inverse();
+    mu += Sigma * best_Hx.transpose() * Qn_inv * best_innovation;
+    mu(2) = normalize_angle(mu(2));
+  }
+  return log_weight;
+}
+
+void FastSlam::update_particle(std::size_t index)
+{
+  Particle& particle = particles_[index];
+  const auto& measurements = *measurements_;
+  const std::size_t m = measurements.size();
+  int* associations = associations_.data() + index * m;
+  Eigen::Vector3d mu;
+  Eigen::Matrix3d Sigma;
+  particle.log_weight += propose(index, mu, Sigma, associations, nearest_.data() + index * m);
+
+  // выбор положения из предложения
+  std::normal_distribution<double> noise(0.0, 1.0);
+  const Eigen::Vector3d sample(noise(particle.rng), noise(particle.rng), noise(particle.rng));
+  particle.pose = mu + Sigma.llt().matrixL() * sample;
+  particle.pose(2) = normalize_angle(particle.pose(2));
+
+  // EKF маяков по выбранному положению, в карте копируются только пути к измененным маякам
+  Eigen::Vector2d measurement_pred;
+  Eigen::Matrix<double, 2, 3> Hx;
+  Eigen::Matrix2d Hm;
+  for (std::size_t i = 0; i < m; ++i) {
+    if (associations[i] < 0) {
+      continue;
+    }
+    LandmarkEstimate landmark = particle.landmarks.get(associations[i]);
+    observation_model(particle.pose, landmark.mean, measurement_pred, Hx, Hm);
+    Eigen::Vector2d innovation = measurements[i] - measurement_pred;
+    innovation(1) = normalize_angle(innovation(1));
+    const Eigen::Matrix2d S = Hm * landmark.covariance * Hm.transpose() + Q_;
+    const Eigen::Matrix2d K = landmark.covariance * Hm.transpose() * S.inverse();
+    landmark.mean += K * innovation;
+    landmark.covariance -= K * S * K.transpose();
+    particle.landmarks.set(associations[i], landmark);
+  }
+}
+
+void FastSlam::add_landmarks(std::size_t index)
+{
+  Particle& particle = particles_[index];
+  Eigen::Vector2d measurement_pred;
+  Eigen::Matrix<double, 2, 3> Hx;
+  Eigen::Matrix2d Hm;
+  for (std::size_t i : new_measurements_) {
+    const Eigen::Vector2d& z = (*measurements_)[i];
+    const double bearing = particle.pose(2) + z(1);
+    LandmarkEstimate landmark;
+    landmark.mean = particle.pose.head<2>() + z(0) * Eigen::Vector2d(std::cos(bearing), std::sin(bearing));
+    // ковариация маяка - ковариация измерения, перенесенная в СК карты
+    observation_model(particle.pose, landmark.mean, measurement_pred, Hx, Hm);
+    const Eigen::Matrix2d Hm_inv = Hm.inverse();
+    landmark.covariance = Hm_inv * Q_ * Hm_inv.transpose();
+    particle.landmarks.push_back(landmark);
+  }
+}
+
+void FastSlam::resample()
+{
+  const std::size_t count = particles_.size();
+  double max_log_weight = -std::numeric_limits<double>::infinity();
+  for (const auto& particle : particles_) {
+    max_log_weight = std::max(max_log_weight, particle.log_weight);
+  }
+  double sum = 0;
+  double sum_squares = 0;
+  for (auto& particle : particles_) {
+    particle.log_weight -= max_log_weight;
+    const double weight = std::exp(particle.log_weight);
+    sum += weight;
+    sum_squares += weight * weight;
+  }
+  // эффективное число частиц
+  if (sum * sum / sum_squares >= 0.5 * count) {
+    return;
+  }
+
+  // низкодисперсная выборка: одно случайное смещение и равномерный шаг по накопленным весам
+  const double step = sum / count;
+  double position = std::uniform_real_distribution<double>(0.0, step)(rng_);
+  double cumulative = std::exp(particles_[0].log_weight);
+  std::size_t source = 0;
+  resampled_.resize(count);
+  for (std::size_t k = 0; k < count; ++k) {
+    while (position > cumulative && source + 1 < count) {
+      cumulative += std::exp(particles_[++source].log_weight);
+    }
+    // копия частицы разделяет с исходной все узлы карты
+    resampled_[k] = particles_[source];
+    resampled_[k].log_weight = 0;
+    resampled_[k].rng.seed(rng_());
+    position += step;
+  }
+  particles_.swap(resampled_);
+}
+
+void FastSlam::update(const Eigen::Vector3d& motion, const std::vector<Eigen::Vector2d>& measurements,
+                      const std::vector<std::vector<int>>& candidates)
+{
+  const std::size_t m = measurements.size();
+  const std::size_t count = particles_.size();
+  measurements_ = &measurements;
+  candidates_ = &candidates;
+  associations_.resize(count * m);
+  nearest_.resize(count * m);
+  predicted_.resize(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    Eigen::Vector3d& mu = predicted_[i];
+    mu = particles_[i].pose;
+    mu(0) += motion(0) * std::cos(mu(2)) - motion(1) * std::sin(mu(2));
+    mu(1) += motion(0) * std::sin(mu(2)) + motion(1) * std::cos(mu(2));
+    mu(2) = normalize_angle(mu(2) + motion(2));
+  }
+  // пробное предложение по всем измерениям дает расстояния до ближайших кандидатов
+  new_landmark_.clear();
+  pool_.parallel_for(count, [&](std::size_t i) {
+    Eigen::Vector3d mu;
+    Eigen::Matrix3d Sigma;
+    propose(i, mu, Sigma, associations_.data() + i * m, nearest_.data() + i * m);
+  });
+
+  // новые маяки - измерения, далекие от всех кандидатов в частицах с большей частью веса.
+  // Решение общее, чтобы новый маяк не оказался в одних частицах вторым экземпляром
+  // уже ассоциированного маяка
+  double max_log_weight = -std::numeric_limits<double>::infinity();
+  for (const auto& particle : particles_) {
+    max_log_weight = std::max(max_log_weight, particle.log_weight);
+  }
+  double total_weight = 0;
+  for (const auto& particle : particles_) {
+    total_weight += std::exp(particle.log_weight - max_log_weight);
+  }
+  new_measurements_.clear();
+  new_landmark_.assign(m, 0);
+  for (std::size_t i = 0; i < m; ++i) {
+    double far_weight = 0;
+    for (std::size_t p = 0; p < count; ++p) {
+      if (nearest_[p * m + i] >= new_landmark_gate_) {
+        far_weight += std::exp(particles_[p].log_weight - max_log_weight);
+      }
+    }
+    if (far_weight > 0.5 * total_weight) {
+      new_landmark_[i] = 1;
+      new_measurements_.push_back(i);
+    }
+  }
+  pool_.parallel_for(count, [&](std::size_t i) { update_particle(i); });
+
+  std::size_t best = 0;
+  for (std::size_t i = 1; i < count; ++i) {
+    if (particles_[i].log_weight > particles_[best].log_weight) {
+      best = i;
+    }
+  }
+
+  observed_landmarks_.clear();
+  for (std::size_t i = 0; i < m; ++i) {
+    const int landmark = associations_[best * m + i];
+    if (landmark >= 0) {
+      observed_landmarks_.push_back(landmark);
+    }
+  }
+  if (!new_measurements_.empty()) {
+    pool_.parallel_for(count, [&](std::size_t i) { add_landmarks(i); });
+    for (std::size_t k = 0; k < new_measurements_.size(); ++k) {
+      observed_landmarks_.push_back(landmark_count_++);
+    }
+  }
+  std::sort(observed_landmarks_.begin(), observed_landmarks_.end());
+  observed_landmarks_.erase(std::unique(observed_landmarks_.begin(), observed_landmarks_.end()),
+                            observed_landmarks_.end());
+
+  best_pose_ = particles_[best].pose;
+  best_landmarks_ = particles_[best].landmarks;
+  resample();
+}
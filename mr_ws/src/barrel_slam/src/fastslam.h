@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <cstddef>
+#include <random>
+#include <vector>
+#include <simple_map/thread_pool.h>
+#include "landmark_map.h"
+
+/**
+ * @brief FastSLAM 2.0 - фильтр частиц по траектории робота с EKF 2x2 для каждого маяка в частице
+ *
+ * Частица хранит положение робота и свою карту маяков (LandmarkMap). Положение выбирается
+ * из предложения, уточненного измерениями скана (FastSLAM 2.0), затем по выбранному положению
+ * обновляются EKF наблюдаемых маяков. Ассоциация выполняется в каждой частице независимо
+ * по максимуму правдоподобия среди кандидатов, что дает многогипотезную ассоциацию,
+ * каждый маяк частицы сопоставляется не более чем одному измерению скана.
+ * Индексы маяков общие для всех частиц, поэтому решение о новом маяке общее: измерение
+ * становится новым маяком, если по пробному предложению оно дальше new_landmark_gate
+ * от всех кандидатов в частицах с большей частью общего веса. Такое измерение
+ * не ассоциируется ни в одной частице, а добавляется во все частицы, каждая
+ * инициализирует маяк от своего положения.
+ * Частицы обновляются параллельно в пуле потоков, передискретизация - низкодисперсная,
+ * когда эффективное число частиц падает ниже половины. Стоимость скана - O(M log n)
+ * для M частиц и n маяков.
+ */
+class FastSlam
+{
+public:
+  struct Particle
+  {
+    Eigen::Vector3d pose;
+    double log_weight;
+    LandmarkMap landmarks;
+    // собственный генератор, чтобы результат не зависел от распределения частиц по потокам
+    std::minstd_rand rng;
+  };
+
+  // threads - число потоков обновления частиц, 0 - по числу ядер,
+  // R и Q - ковариации возмущения движения за скан и измерения (дальность, пеленг),
+  // association_gate и new_landmark_gate - пороги квадрата расстояния Махаланобиса
+  FastSlam(std::size_t particles, std::size_t threads, const Eigen::Matrix3d& R, const Eigen::Matrix2d& Q,
+           double association_gate, double new_landmark_gate, unsigned seed = 1);
+
+  // Шаг фильтра по скану: перемещение робота motion в его СК на время прошлого шага,
+  // измерения маяков (дальность, пеленг) и кандидаты ассоциации для каждого измерения
+  void update(const Eigen::Vector3d& motion, const std::vector<Eigen::Vector2d>& measurements,
+              const std::vector<std::vector<int>>& candidates);
+
+  // Оценка частицы с наибольшим весом на последнем шаге
+  const Eigen::Vector3d& pose() const { return best_pose_; }
+  const Eigen::Vector2d& landmark(std::size_t i) const { return best_landmarks_.get(i).mean; }
+  std::size_t landmark_count() const { return landmark_count_; }
+  // Маяки, наблюдавшиеся лучшей частицей или добавленные на последнем шаге
+  const std::vector<std::size_t>& observed_landmarks() const { return observed_landmarks_; }
+  const std::vector<Particle>& particles() const { return particles_; }
+
+private:
+  // Предложение FastSLAM 2.0 для частицы: положение mu и ковариация Sigma, ассоциации
+  // и квадраты расстояния до ближайшего кандидата по измерениям. Возвращает логарифм веса
+  double propose(std::size_t index, Eigen::Vector3d& mu, Eigen::Matrix3d& Sigma, int* associations,
+                 double* nearest) const;
+  // Предложение, выбор положения и обновление маяков одной частицы
+  void update_particle(std::size_t index);
+  // Добавление новых маяков new_measurements_ в частицу
+  void add_landmarks(std::size_t index);
+  void resample();
+
+  Eigen::Matrix3d R_;
+  Eigen::Matrix2d Q_;
+  double association_gate_;
+  double new_landmark_gate_;
+  std::vector<Particle> particles_;
+  std::vector<Particle> resampled_;
+  simple_map::ThreadPool pool_;
+  std::minstd_rand rng_;
+  std::size_t landmark_count_ = 0;
+
+  // данные текущего шага
+  const std::vector<Eigen::Vector2d>* measurements_ = nullptr;
+  const std::vector<std::vector<int>>* candidates_ = nullptr;
+  // прогноз положения каждой частицы по перемещению
+  std::vector<Eigen::Vector3d> predicted_;
+  // ассоциации и квадраты расстояния до ближайшего кандидата: частица * измерение
+  std::vector<int> associations_;
+  std::vector<double> nearest_;
+  // измерения новых маяков и их признак по номеру измерения
+  std::vector<std::size_t> new_measurements_;
+  std::vector<char> new_landmark_;
+
+  Eigen::Vector3d best_pose_ = Eigen::Vector3d::Zero();
+  LandmarkMap best_landmarks_;
+  std::vector<std::size_t> observed_landmarks_;
+};
@@ -0,0 +1,144 @@
+#include "joint_compatibility.h"
+#include <Eigen/Cholesky>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+// Квантиль стандартного нормального распределения для p > 0.5,
+// рациональное приближение Абрамовица-Стигана 26.2.23, ошибка меньше 4.5e-4
+double normal_quantile(double p)
+{
+  const double t = std::sqrt(-2.0 * std::log(1.0 - p));
+  return t - (2.515517 + 0.802853 * t + 0.010328 * t * t) /
+             (1.0 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+}
+
+}
+
+JointCompatibility::JointCompatibility(double confidence, std::size_t max_nodes) :
+    z_quantile_(normal_quantile(confidence)),
+    max_nodes_(max_nodes)
+{
+}
+
+double JointCompatibility::threshold(std::size_t dof)
+{
+  // аппроксимация Уилсона-Хилферти: (chi2/dof)^(1/3) распределено почти нормально
+  while (thresholds_.size() <= dof) {
+    const double k = thresholds_.size();
+    if (k == 0) {
+      thresholds_.push_back(0);
+      continue;
+    }
+    const double a = 2.0 / (9.0 * k);
+    thresholds_.push_back(k * std::pow(1.0 - a + z_quantile_ * std::sqrt(a), 3));
+  }
+  return thresholds_[dof];
+}
+
+Eigen::Matrix2d JointCompatibility::cross_covariance(const AssociationPair& a, const AssociationPair& b) const
+{
+  const Eigen::Ref<const Eigen::MatrixXd>& P = *P_;
+  return a.Gi_x * (P.topLeftCorner<3, 3>() * b.Gi_x.transpose() + P.block<3, 2>(0, b.offset) * b.Gi_m.transpose())
+       + a.Gi_m * (P.block<2, 3>(a.offset, 0) * b.Gi_x.transpose() + P.block<2, 2>(a.offset, b.offset) * b.Gi_m.transpose());
+}
+
+double JointCompatibility::extend(const AssociationPair& pair, std::size_t pairs, double distance)
+{
+  const std::size_t k = 2 * pairs;
+  // блоки связи новой пары с парами гипотезы
+  auto C = cross_.topRows(k);
+  for (std::size_t b = 0; b < pairs; ++b) {
+    C.middleRows<2>(2 * b) = cross_covariance(*hypothesis_[b], pair);
+  }
+  // новая строка множителя: L * row^T = C
+  L_.topLeftCorner(k, k).triangularView<Eigen::Lower>().solveInPlace(C);
+  const Eigen::Matrix2d D = cross_covariance(pair, pair) + *Q_ - C.transpose() * C;
+  Eigen::LLT<Eigen::Matrix2d> llt(D);
+  if (llt.info() != Eigen::Success) {
+    return -1;
+  }
+  L_.block(k, 0, 2, k) = C.transpose();
+  L_.block<2, 2>(k, k) = llt.matrixL();
+  // выбеленная невязка новой пары, ее квадрат добавляется к совместному расстоянию
+  Eigen::Vector2d w = pair.innovation - C.transpose() * whitened_.head(k);
+  llt.matrixL().solveInPlace(w);
+  whitened_.segment<2>(k) = w;
+  return distance + w.squaredNorm();
+}
+
+void JointCompatibility::search(std::size_t measurement, std::size_t pairs, double distance)
+{
+  const auto& candidates = *candidates_;
+  const std::size_t m = measurement_count_;
+  if (measurement == m) {
+    // из гипотез с равным числом пар выбирается гипотеза с меньшим совместным расстоянием
+    if (pairs > best_pairs_ || (pairs == best_pairs_ && distance < best_distance_)) {
+      best_pairs_ = pairs;
+      best_distance_ = distance;
+      best_ = current_;
+    }
+    return;
+  }
+  if (++nodes_ > max_nodes_) {
+    return;
+  }
+  // продолжать имеет смысл, только если можно получить больше пар, чем в лучшей гипотезе,
+  // или столько же при меньшем совместном расстоянии: с каждой парой расстояние только растет
+  if (improves(pairs + m - measurement, distance)) {
+    for (const auto& pair : candidates[measurement]) {
+      if (landmark_used_[pair.landmark]) {
+        continue;
+      }
+      const double joint = extend(pair, pairs, distance);
+      if (joint < 0 || joint > threshold(2 * (pairs + 1))) {
+        continue;
+      }
+      landmark_used_[pair.landmark] = 1;
+      hypothesis_[pairs] = &pair;
+      current_[measurement] = pair.landmark;
+      search(measurement + 1, pairs + 1, joint);
+      landmark_used_[pair.landmark] = 0;
+    }
+  }
+  current_[measurement] = -1;
+  if (improves(pairs + m - measurement - 1, distance)) {
+    search(measurement + 1, pairs, distance);
+  }
+}
+
+void JointCompatibility::reserve(std::size_t max_measurements, std::size_t max_landmarks)
+{
+  // используются только начальные блоки буферов, поэтому они не уменьшаются под скан
+  if (static_cast<std::size_t>(whitened_.size()) < 2 * max_measurements) {
+    L_.resize(2 * max_measurements, 2 * max_measurements);
+    cross_.resize(2 * max_measurements, 2);
+    whitened_.resize(2 * max_measurements);
+  }
+  hypothesis_.reserve(max_measurements);
+  current_.reserve(max_measurements);
+  best_.reserve(max_measurements);
+  landmark_used_.reserve(max_landmarks);
+}
+
+void JointCompatibility::associate(const Eigen::Ref<const Eigen::MatrixXd>& P, const Eigen::Matrix2d& Q, std::size_t landmark_count,
+                                   const std::vector<AssociationPairs>& candidates, std::size_t measurement_count,
+                                   std::vector<int>& associations)
+{
+  const std::size_t m = measurement_count;
+  measurement_count_ = m;
+  P_ = &P;
+  Q_ = &Q;
+  candidates_ = &candidates;
+  nodes_ = 0;
+  reserve(m, landmark_count);
+  hypothesis_.assign(m, nullptr);
+  landmark_used_.assign(landmark_count, 0);
+  current_.assign(m, -1);
+  best_.assign(m, -1);
+  best_pairs_ = 0;
+  best_distance_ = std::numeric_limits<double>::infinity();
+  search(0, 0, 0);
+  associations = best_;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <cstddef>
+#include <vector>
+
+// Индивидуально совместимая пара измерение - маяк
+struct AssociationPair
+{
+  // индекс маяка и смещение его координат в векторе состояния
+  int landmark;
+  std::size_t offset;
+  // квадрат расстояния Махаланобиса пары
+  double distance;
+  // невязка измерения и якобианы по роботу и маяку
+  Eigen::Vector2d innovation;
+  Eigen::Matrix<double, 2, 3> Gi_x;
+  Eigen::Matrix2d Gi_m;
+};
+
+// Пары содержат выровненные матрицы Eigen фиксированного размера, поэтому нужен выровненный аллокатор
+typedef std::vector<AssociationPair, Eigen::aligned_allocator<AssociationPair>> AssociationPairs;
+
+/**
+ * @brief Совместная ассоциация измерений скана методом JCBB (joint compatibility branch and bound)
+ *
+ * Перебирает гипотезы ассоциации всех измерений скана сразу и выбирает гипотезу с максимальным
+ * числом пар, совместная невязка которой проходит порог chi2. Разложение Холецкого совместной
+ * ковариации невязки наращивается по одному блоку 2x2 при углублении поиска, поэтому проверка
+ * очередной пары стоит O(k^2), а не O(k^3). Из гипотез с равным числом пар выбирается гипотеза
+ * с меньшим совместным расстоянием Махаланобиса. Ветви, которые не могут дать больше пар,
+ * чем лучшая найденная гипотеза, или столько же с меньшим расстоянием, отсекаются.
+ */
+class JointCompatibility
+{
+public:
+  // confidence - доверительная вероятность порогов chi2,
+  // max_nodes - ограничение числа узлов поиска, после него возвращается лучшая найденная гипотеза
+  JointCompatibility(double confidence, std::size_t max_nodes);
+
+  // candidates[i] - индивидуально совместимые пары для i-го из measurement_count измерений
+  // (candidates может быть длиннее, чтобы буферы пар не перевыделялись от скана к скану),
+  // в associations[i] записывается индекс маяка или -1, если измерение осталось без пары
+  void associate(const Eigen::Ref<const Eigen::MatrixXd>& P, const Eigen::Matrix2d& Q, std::size_t landmark_count,
+                 const std::vector<AssociationPairs>& candidates, std::size_t measurement_count,
+                 std::vector<int>& associations);
+  // Выделение буферов поиска под max_measurements измерений скана и max_landmarks маяков заранее,
+  // при больших значениях буферы растут в associate и больше не уменьшаются
+  void reserve(std::size_t max_measurements, std::size_t max_landmarks);
+
+private:
+  void search(std::size_t measurement, std::size_t pairs, double distance);
+  // Может ли гипотеза с max_pairs парами и расстоянием не меньше distance быть лучше найденной
+  bool improves(std::size_t max_pairs, double distance) const
+  {
+    return max_pairs > best_pairs_ || (max_pairs == best_pairs_ && distance < best_distance_);
+  }
+  // Добавляет пару в разложение на уровне pairs, возвращает совместное расстояние или -1,
+  // если совместная ковариация вырождена
+  double extend(const AssociationPair& pair, std::size_t pairs, double distance);
+  // Блок Gi_a * P * Gi_b^T совместной ковариации невязки
+  Eigen::Matrix2d cross_covariance(const AssociationPair& a, const AssociationPair& b) const;
+  // Квантиль chi2 для dof степеней свободы
+  double threshold(std::size_t dof);
+
+  double z_quantile_;
+  std::size_t max_nodes_;
+  std::vector<double> thresholds_;
+
+  // данные текущего вызова associate
+  const Eigen::Ref<const Eigen::MatrixXd>* P_ = nullptr;
+  const Eigen::Matrix2d* Q_ = nullptr;
+  const std::vector<AssociationPairs>* candidates_ = nullptr;
+  std::size_t measurement_count_ = 0;
+  std::size_t nodes_ = 0;
+  // нижнетреугольный множитель Холецкого и выбеленная невязка текущей гипотезы,
+  // строки 2k, 2k+1 относятся к k-й паре гипотезы
+  Eigen::MatrixXd L_;
+  Eigen::VectorXd whitened_;
+  // буфер блоков связи добавляемой пары с парами гипотезы
+  Eigen::Matrix<double, Eigen::Dynamic, 2> cross_;
+  std::vector<const AssociationPair*> hypothesis_;
+  std::vector<char> landmark_used_;
+  std::vector<int> current_;
+  std::vector<int> best_;
+  std::size_t best_pairs_ = 0;
+  double best_distance_ = 0;
+};
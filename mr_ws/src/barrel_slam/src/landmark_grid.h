@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Равномерная сетка над положениями маяков для быстрого поиска кандидатов при ассоциации
+ *
+ * Маяки раскладываются по квадратным ячейкам размера cell_size, хранятся только непустые
+ * ячейки. Поиск в радиусе не больше cell_size просматривает 3x3 ячейки вокруг точки,
+ * так что время поиска не зависит от общего числа маяков.
+ */
+class LandmarkGrid
+{
+public:
+  explicit LandmarkGrid(double cell_size = 5.0) : cell_size_(cell_size) {}
+
+  void set_cell_size(double cell_size)
+  {
+    cell_size_ = cell_size;
+    clear();
+  }
+  double cell_size() const { return cell_size_; }
+
+  void clear() { cells_.clear(); }
+
+  void insert(int index, const Eigen::Vector2d& position)
+  {
+    cells_[key(cell_coord(position.x()), cell_coord(position.y()))].push_back(index);
+  }
+
+  // Переносит маяк index из ячейки положения from в ячейку положения to
+  void move(int index, const Eigen::Vector2d& from, const Eigen::Vector2d& to)
+  {
+    const std::int64_t from_key = key(cell_coord(from.x()), cell_coord(from.y()));
+    const std::int64_t to_key = key(cell_coord(to.x()), cell_coord(to.y()));
+    if (from_key == to_key) {
+      return;
+    }
+    const auto it = cells_.find(from_key);
+    if (it != cells_.end()) {
+      std::vector<int>& cell = it->second;
+      cell.erase(std::remove(cell.begin(), cell.end(), index), cell.end());
+      if (cell.empty()) {
+        cells_.erase(it);
+      }
+    }
+    cells_[to_key].push_back(index);
+  }
+
+  // Добавляет в candidates индексы маяков из ячеек, пересекающих круг радиуса radius вокруг point.
+  // Кандидаты могут лежать дальше radius, точная проверка остается вызывающему
+  void query(const Eigen::Vector2d& point, double radius, std::vector<int>& candidates) const
+  {
+    const int x0 = cell_coord(point.x() - radius);
+    const int x1 = cell_coord(point.x() + radius);
+    const int y0 = cell_coord(point.y() - radius);
+    const int y1 = cell_coord(point.y() + radius);
+    for (int cy = y0; cy <= y1; ++cy) {
+      for (int cx = x0; cx <= x1; ++cx) {
+        const auto it = cells_.find(key(cx, cy));
+        if (it != cells_.end()) {
+          candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+        }
+      }
+    }
+  }
+
+private:
+  int cell_coord(double v) const { return static_cast<int>(std::floor(v / cell_size_)); }
+
+  static std::int64_t key(int cx, int cy)
+  {
+    return (static_cast<std::int64_t>(cx) << 32) | static_cast<std::uint32_t>(cy);
+  }
+
+  double cell_size_;
+  std::unordered_map<std::int64_t, std::vector<int>> cells_;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <cstddef>
+#include <memory>
+
+// Оценка маяка в частице FastSLAM: положение и его ковариация
+struct LandmarkEstimate
+{
+  Eigen::Vector2d mean;
+  Eigen::Matrix2d covariance;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/**
+ * @brief Неизменяемая карта маяков частицы - сбалансированное двоичное дерево по битам индекса
+ *
+ * Узлы дерева не меняются после создания и разделяются между копиями карты, поэтому копирование
+ * карты при передискретизации частиц стоит O(1), а изменение маяка копирует только путь от корня
+ * до листа, O(log n). Разные частицы могут читать общие узлы из разных потоков одновременно.
+ */
+class LandmarkMap
+{
+public:
+  std::size_t size() const { return size_; }
+
+  const LandmarkEstimate& get(std::size_t index) const
+  {
+    const Node* node = root_.get();
+    for (int level = depth_ - 1; level >= 0; --level) {
+      node = node->children[(index >> level) & 1].get();
+    }
+    return node->value;
+  }
+
+  void set(std::size_t index, const LandmarkEstimate& value)
+  {
+    root_ = set(root_.get(), depth_, index, value);
+  }
+
+  void push_back(const LandmarkEstimate& value)
+  {
+    // дерево заполнено - новый корень, старое дерево становится его левой половиной
+    if (size_ == (std::size_t(1) << depth_)) {
+      std::shared_ptr<Node> root(new Node);
+      root->children[0] = root_;
+      root_ = root;
+      ++depth_;
+    }
+    root_ = set(root_.get(), depth_, size_, value);
+    ++size_;
+  }
+
+private:
+  struct Node
+  {
+    std::shared_ptr<const Node> children[2];
+    LandmarkEstimate value;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  // Копия пути до листа index в поддереве node высоты level, недостающие узлы создаются
+  static std::shared_ptr<const Node> set(const Node* node, int level, std::size_t index, const LandmarkEstimate& value)
+  {
+    std::shared_ptr<Node> copy(node ? new Node(*node) : new Node);
+    if (level == 0) {
+      copy->value = value;
+    } else {
+      const int bit = (index >> (level - 1)) & 1;
+      copy->children[bit] = set(copy->children[bit].get(), level - 1, index, value);
+    }
+    return copy;
+  }
+
+  std::shared_ptr<const Node> root_;
+  int depth_ = 0;
+  std::size_t size_ = 0;
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Кольцевой буфер сообщений одометрии с проинтегрированным по ним положением
+ *
+ * Скорости каждого сообщения действуют до следующего сообщения. Положение на время
+ * очередного сообщения интегрируется при добавлении точно (движение по дуге
+ * с постоянными v и w), так что перемещение между двумя любыми моментами внутри буфера
+ * находится бинарным поиском и одним шагом от ближайшего предыдущего сообщения.
+ * Положение накапливается в собственной СК одометрии, используется только разность.
+ */
+class OdometryBuffer
+{
+public:
+  explicit OdometryBuffer(std::size_t capacity = 500) : samples_(std::max<std::size_t>(capacity, 1)) {}
+
+  bool empty() const { return size_ == 0; }
+  std::size_t size() const { return size_; }
+
+  // Добавляет сообщение со скоростями v, w на время stamp, сообщения не по порядку отбрасываются.
+  // При заполнении буфера вытесняется самое старое сообщение
+  void push(double stamp, double v, double w)
+  {
+    Sample sample{stamp, v, w, Eigen::Vector3d::Zero()};
+    if (size_ > 0) {
+      const Sample& last = at(size_ - 1);
+      if (stamp < last.stamp) {
+        return;
+      }
+      sample.pose = advance(last.pose, last.v, last.w, stamp - last.stamp);
+    }
+    if (size_ == samples_.size()) {
+      first_ = (first_ + 1) % samples_.size();
+      --size_;
+    }
+    samples_[(first_ + size_) % samples_.size()] = sample;
+    ++size_;
+  }
+
+  // Положение на время stamp в СК одометрии. После последнего сообщения продолжается
+  // движение с его скоростями, до первого - с его же скоростями назад
+  Eigen::Vector3d pose(double stamp) const
+  {
+    if (size_ == 0) {
+      return Eigen::Vector3d::Zero();
+    }
+    // последнее сообщение не позже stamp
+    std::size_t lo = 0, hi = size_;
+    while (hi - lo > 1) {
+      const std::size_t mid = (lo + hi) / 2;
+      if (at(mid).stamp <= stamp) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    const Sample& sample = at(lo);
+    return advance(sample.pose, sample.v, sample.w, stamp - sample.stamp);
+  }
+
+  // Перемещение робота с времени from до времени to в СК робота на время from
+  Eigen::Vector3d motion(double from, double to) const
+  {
+    const Eigen::Vector3d start = pose(from);
+    const Eigen::Vector3d finish = pose(to);
+    const double c = std::cos(start(2));
+    const double s = std::sin(start(2));
+    const double dx = finish(0) - start(0);
+    const double dy = finish(1) - start(1);
+    return Eigen::Vector3d(c * dx + s * dy, -s * dx + c * dy, normalize_angle(finish(2) - start(2)));
+  }
+
+  // Движение из положения pose с постоянными скоростями v, w за время dt
+  static Eigen::Vector3d advance(const Eigen::Vector3d& pose, double v, double w, double dt)
+  {
+    const double heading = pose(2) + w * dt;
+    Eigen::Vector3d result;
+    if (std::abs(w * dt) < 1e-9) {
+      // почти прямолинейное движение, формула дуги вырождается
+      result(0) = pose(0) + v * dt * std::cos(pose(2));
+      result(1) = pose(1) + v * dt * std::sin(pose(2));
+    } else {
+      result(0) = pose(0) + v / w * (std::sin(heading) - std::sin(pose(2)));
+      result(1) = pose(1) + v / w * (std::cos(pose(2)) - std::cos(heading));
+    }
+    result(2) = normalize_angle(heading);
+    return result;
+  }
+
+private:
+  struct Sample
+  {
+    double stamp;
+    double v;
+    double w;
+    // положение на время stamp
+    Eigen::Vector3d pose;
+  };
+
+  static double normalize_angle(double a) { return std::atan2(std::sin(a), std::cos(a)); }
+
+  // i-е сообщение от самого старого
+  const Sample& at(std::size_t i) const { return samples_[(first_ + i) % samples_.size()]; }
+
+  std::vector<Sample> samples_;
+  std::size_t first_ = 0;
+  std::size_t size_ = 0;
+};
@@ -0,0 +1,504 @@
+#include "pose_graph.h"
+#include <Eigen/Cholesky>
+#include <Eigen/LU>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+// Шаг Гаусса-Ньютона, после которого итерации прекращаются
+const double kTolerance = 1e-6;
+
+double normalize_angle(double a)
+{
+  return std::atan2(std::sin(a), std::cos(a));
+}
+
+}
+
+PoseGraph::PoseGraph(std::size_t window, std::size_t relinearize_interval, std::size_t relinearize_budget,
+                     std::size_t iterations) :
+    window_(std::max<std::size_t>(window, 1)),
+    relinearize_interval_(std::max<std::size_t>(relinearize_interval, 1)),
+    relinearize_budget_(std::max<std::size_t>(relinearize_budget, 1)),
+    iterations_(std::max<std::size_t>(iterations, 1))
+{
+}
+
+PoseGraph::~PoseGraph()
+{
+  if (pass_thread_.joinable()) {
+    pass_thread_.join();
+  }
+}
+
+std::size_t PoseGraph::add_variable(int dim, std::size_t index, const double* value)
+{
+  Variable variable;
+  variable.offset = values_.size();
+  variable.dim = dim;
+  variable.index = index;
+  values_.insert(values_.end(), value, value + dim);
+  variables_.push_back(variable);
+  return variables_.size() - 1;
+}
+
+std::size_t PoseGraph::add_pose(const Eigen::Vector3d& pose)
+{
+  pose_variables_.push_back(add_variable(3, pose_variables_.size(), pose.data()));
+  return pose_variables_.size() - 1;
+}
+
+std::size_t PoseGraph::add_landmark(const Eigen::Vector2d& landmark)
+{
+  landmark_variables_.push_back(add_variable(2, landmark_variables_.size(), landmark.data()));
+  landmark_information_.push_back(Eigen::Matrix2d::Zero());
+  landmark_prior_information_.push_back(Eigen::Matrix2d::Zero());
+  landmark_prior_vector_.push_back(Eigen::Vector2d::Zero());
+  return landmark_variables_.size() - 1;
+}
+
+std::size_t PoseGraph::add_factor(const Factor& factor)
+{
+  factors_.push_back(factor);
+  const std::size_t index = factors_.size() - 1;
+  variables_[factor.a].factors.push_back(index);
+  variables_[factor.b].factors.push_back(index);
+  return index;
+}
+
+void PoseGraph::add_odometry(std::size_t from, std::size_t to, const Eigen::Vector3d& delta,
+                             const Eigen::Matrix3d& covariance)
+{
+  Factor factor;
+  factor.a = pose_variables_[from];
+  factor.b = pose_variables_[to];
+  factor.dim = 3;
+  factor.measurement = delta;
+  factor.sqrt_information = covariance.inverse().llt().matrixU();
+  add_factor(factor);
+}
+
+void PoseGraph::add_observation(std::size_t pose, std::size_t landmark, const Eigen::Vector2d& measurement,
+                                const Eigen::Matrix2d& covariance)
+{
+  Factor factor;
+  factor.a = pose_variables_[pose];
+  factor.b = landmark_variables_[landmark];
+  factor.dim = 2;
+  factor.measurement << measurement, 0;
+  factor.sqrt_information.setZero();
+  factor.sqrt_information.topLeftCorner<2, 2>() = covariance.inverse().llt().matrixU();
+  // информация маяка нужна для ассоциации следующих измерений еще до решения
+  Residual residual;
+  Jacobian Ja, Jb;
+  linearize(factor, residual, Ja, Jb);
+  landmark_information_[landmark] += Jb.transpose() * Jb;
+  add_factor(factor);
+}
+
+Eigen::Vector3d PoseGraph::pose(std::size_t i) const
+{
+  return Eigen::Map<const Eigen::Vector3d>(&values_[variables_[pose_variables_[i]].offset]);
+}
+
+Eigen::Vector2d PoseGraph::landmark(std::size_t i) const
+{
+  return Eigen::Map<const Eigen::Vector2d>(&values_[variables_[landmark_variables_[i]].offset]);
+}
+
+Eigen::Matrix2d PoseGraph::landmark_covariance(std::size_t i) const
+{
+  return landmark_information_[i].inverse();
+}
+
+void PoseGraph::linearize(const Factor& factor, Residual& residual, Jacobian& Ja, Jacobian& Jb) const
+{
+  const Eigen::Map<const Eigen::Vector3d> pose(&values_[variables_[factor.a].offset]);
+  const double c = std::cos(pose(2));
+  const double s = std::sin(pose(2));
+  if (factor.dim == 3) {
+    // перемещение в СК первого положения: R(theta_a)^T * (p_b - p_a), theta_b - theta_a
+    const Eigen::Map<const Eigen::Vector3d> next(&values_[variables_[factor.b].offset]);
+    const double dx = next(0) - pose(0);
+    const double dy = next(1) - pose(1);
+    residual.resize(3);
+    residual << c * dx + s * dy - factor.measurement(0),
+                -s * dx + c * dy - factor.measurement(1),
+                normalize_angle(next(2) - pose(2) - factor.measurement(2));
+    Ja.resize(3, 3);
+    Ja << -c, -s, -s * dx + c * dy,
+          s, -c, -c * dx - s * dy,
+          0, 0, -1;
+    Jb.resize(3, 3);
+    Jb << c, s, 0,
+          -s, c, 0,
+          0, 0, 1;
+  } else {
+    // дальность и пеленг маяка, как в observation_model фильтра
+    const Eigen::Map<const Eigen::Vector2d> landmark(&values_[variables_[factor.b].offset]);
+    const double dx = landmark(0) - pose(0);
+    const double dy = landmark(1) - pose(1);
+    const double dist2 = dx * dx + dy * dy;
+    const double dist = std::sqrt(dist2);
+    residual.resize(2);
+    residual << dist - factor.measurement(0),
+                normalize_angle(std::atan2(dy, dx) - pose(2) - factor.measurement(1));
+    Ja.resize(2, 3);
+    Ja << -dx / dist, -dy / dist, 0,
+          dy / dist2, -dx / dist2, -1;
+    Jb.resize(2, 2);
+    Jb << dx / dist, dy / dist,
+          -dy / dist2, dx / dist2;
+  }
+  const auto W = factor.sqrt_information.topLeftCorner(factor.dim, factor.dim);
+  residual = W * residual;
+  Ja = W * Ja;
+  Jb = W * Jb;
+}
+
+void PoseGraph::add_block(const Variable& row, const Variable& col, const Jacobian& block)
+{
+  for (int i = 0; i < row.dim; ++i) {
+    for (int j = 0; j < col.dim; ++j) {
+      if (row.column > col.column) {
+        triplets_.emplace_back(row.column + i, col.column + j, block(i, j));
+      } else if (row.column < col.column) {
+        triplets_.emplace_back(col.column + j, row.column + i, block(i, j));
+      } else if (i >= j) {
+        triplets_.emplace_back(row.column + i, col.column + j, block(i, j));
+      }
+    }
+  }
+}
+
+void PoseGraph::build_system(Eigen::Index size, bool reuse_structure, bool full)
+{
+  triplets_.clear();
+  g_.setZero(size);
+  for (std::size_t v : system_variables_) {
+    const Variable& variable = variables_[v];
+    if (variable.dim != 2) {
+      continue;
+    }
+    landmark_information_[variable.index].setZero();
+    if (!full) {
+      // измерения из положений вне окна входят априорной информацией маяка
+      const Eigen::Matrix2d& A = landmark_prior_information_[variable.index];
+      add_block(variable, variable, A);
+      g_.segment<2>(variable.column) += A * landmark(variable.index) - landmark_prior_vector_[variable.index];
+      landmark_information_[variable.index] += A;
+    }
+  }
+  // самое старое положение окна при фиксированном предыдущем держится априорным фактором,
+  // который заменяет фактор одометрии от предыдущего положения
+  const bool use_prior = prior_pose_ > 0 && variables_[pose_variables_[prior_pose_]].column >= 0 &&
+                         variables_[pose_variables_[prior_pose_ - 1]].column < 0;
+  Residual residual;
+  Jacobian Ja, Jb;
+  for (std::size_t f : system_factors_) {
+    if (use_prior && f == prior_factor_) {
+      continue;
+    }
+    const Factor& factor = factors_[f];
+    const Variable& a = variables_[factor.a];
+    const Variable& b = variables_[factor.b];
+    linearize(factor, residual, Ja, Jb);
+    // фиксированные переменные входят в систему только своими значениями в невязке.
+    // Блоки всегда добавляются в одном порядке, поэтому структура H одна и та же на всех итерациях
+    if (a.column >= 0) {
+      add_block(a, a, Ja.transpose() * Ja);
+      g_.segment(a.column, a.dim) += Ja.transpose() * residual;
+    }
+    if (b.column >= 0) {
+      add_block(b, b, Jb.transpose() * Jb);
+      g_.segment(b.column, b.dim) += Jb.transpose() * residual;
+      if (factor.dim == 2) {
+        landmark_information_[b.index] += Jb.transpose() * Jb;
+      }
+    }
+    if (a.column >= 0 && b.column >= 0) {
+      add_block(a, b, Ja.transpose() * Jb);
+    }
+  }
+  if (use_prior) {
+    const Variable& variable = variables_[pose_variables_[prior_pose_]];
+    Eigen::Vector3d offset = pose(prior_pose_) - prior_mean_;
+    offset(2) = normalize_angle(offset(2));
+    add_block(variable, variable, prior_sqrt_information_.transpose() * prior_sqrt_information_);
+    g_.segment<3>(variable.column) += prior_sqrt_information_.transpose() * (prior_sqrt_information_ * offset);
+  }
+  if (!reuse_structure) {
+    H_.resize(size, size);
+    H_.setFromTriplets(triplets_.begin(), triplets_.end());
+    // положение каждого элемента в массиве значений H, чтобы на следующих итерациях
+    // складывать значения на место без сортировки
+    triplet_positions_.resize(triplets_.size());
+    for (std::size_t t = 0; t < triplets_.size(); ++t) {
+      const Eigen::Index col = triplets_[t].col();
+      const int* begin = H_.innerIndexPtr() + H_.outerIndexPtr()[col];
+      const int* end = H_.innerIndexPtr() + H_.outerIndexPtr()[col + 1];
+      triplet_positions_[t] = std::lower_bound(begin, end, triplets_[t].row()) - H_.innerIndexPtr();
+    }
+    return;
+  }
+  H_.coeffs().setZero();
+  for (std::size_t t = 0; t < triplets_.size(); ++t) {
+    H_.valuePtr()[triplet_positions_[t]] += triplets_[t].value();
+  }
+}
+
+void PoseGraph::solve(bool full)
+{
+  // столбцы переменных и факторы, связанные хотя бы с одной из них
+  ++stamp_;
+  Eigen::Index size = 0;
+  system_factors_.clear();
+  auto collect = [this](const std::vector<std::size_t>& factors) {
+    for (std::size_t f : factors) {
+      if (factors_[f].stamp != stamp_) {
+        factors_[f].stamp = stamp_;
+        system_factors_.push_back(f);
+      }
+    }
+  };
+  for (std::size_t v : system_variables_) {
+    Variable& variable = variables_[v];
+    variable.column = size;
+    size += variable.dim;
+    collect(variable.factors);
+    if (full) {
+      collect(variable.marginalized_factors);
+    }
+  }
+  last_system_size_ = size;
+
+  for (std::size_t iteration = 0; size > 0 && iteration < iterations_; ++iteration) {
+    build_system(size, iteration > 0, full);
+    if (iteration == 0) {
+      ldlt_.analyzePattern(H_);
+    }
+    ldlt_.factorize(H_);
+    if (ldlt_.info() != Eigen::Success) {
+      break;
+    }
+    delta_ = ldlt_.solve(-g_);
+    for (std::size_t v : system_variables_) {
+      const Variable& variable = variables_[v];
+      Eigen::Map<Eigen::VectorXd>(&values_[variable.offset], variable.dim) += delta_.segment(variable.column, variable.dim);
+      if (variable.dim == 3) {
+        values_[variable.offset + 2] = normalize_angle(values_[variable.offset + 2]);
+      }
+    }
+    if (delta_.lpNorm<Eigen::Infinity>() < kTolerance) {
+      break;
+    }
+  }
+
+  updated_landmarks_.clear();
+  for (std::size_t v : system_variables_) {
+    variables_[v].column = -1;
+    if (variables_[v].dim == 2) {
+      updated_landmarks_.push_back(variables_[v].index);
+    }
+  }
+}
+
+void PoseGraph::fold_observation(std::size_t f)
+{
+  // положение вне окна фиксировано, поэтому фактор зависит только от маяка
+  Residual residual;
+  Jacobian Ja, Jb;
+  linearize(factors_[f], residual, Ja, Jb);
+  const std::size_t index = variables_[factors_[f].b].index;
+  const Eigen::Matrix2d A = Jb.transpose() * Jb;
+  landmark_prior_information_[index] += A;
+  landmark_prior_vector_[index] += A * landmark(index) - Jb.transpose() * residual;
+}
+
+void PoseGraph::refold_observations()
+{
+  landmark_prior_information_.assign(landmark_count(), Eigen::Matrix2d::Zero());
+  landmark_prior_vector_.assign(landmark_count(), Eigen::Vector2d::Zero());
+  for (std::size_t v : landmark_variables_) {
+    for (std::size_t f : variables_[v].marginalized_factors) {
+      fold_observation(f);
+    }
+  }
+}
+
+void PoseGraph::advance_prior()
+{
+  const std::size_t previous = prior_pose_;
+  const std::size_t next = prior_pose_ + 1;
+  const std::size_t from = pose_variables_[previous];
+  const std::size_t to = pose_variables_[next];
+  // измерения маяков из выходящего положения больше не решаются в окне
+  for (std::size_t f : variables_[from].factors) {
+    if (factors_[f].dim != 2) {
+      continue;
+    }
+    fold_observation(f);
+    Variable& landmark = variables_[factors_[f].b];
+    landmark.factors.erase(std::find(landmark.factors.begin(), landmark.factors.end(), f));
+    landmark.marginalized_factors.push_back(f);
+  }
+  std::size_t odometry = std::numeric_limits<std::size_t>::max();
+  for (std::size_t f : variables_[to].factors) {
+    if (factors_[f].dim == 3 && factors_[f].a == from && factors_[f].b == to) {
+      odometry = f;
+    }
+  }
+  Eigen::Matrix3d information = Eigen::Matrix3d::Zero();
+  Eigen::Vector3d gradient = Eigen::Vector3d::Zero();
+  if (odometry != std::numeric_limits<std::size_t>::max()) {
+    // исключение предыдущего положения из задачи по нему и next с его априорным фактором
+    // и фактором одометрии между ними: дополнение Шура в точке текущих оценок.
+    // Первое положение закреплено, тогда остается только фактор одометрии
+    Residual residual;
+    Jacobian Ja, Jb;
+    linearize(factors_[odometry], residual, Ja, Jb);
+    information = Jb.transpose() * Jb;
+    gradient = Jb.transpose() * residual;
+    if (previous > 0) {
+      Eigen::Vector3d offset = pose(previous) - prior_mean_;
+      offset(2) = normalize_angle(offset(2));
+      const Eigen::Matrix3d prior_information = prior_sqrt_information_.transpose() * prior_sqrt_information_;
+      const Eigen::Matrix3d Hpp = prior_information + Ja.transpose() * Ja;
+      const Eigen::Matrix3d Hpq = Ja.transpose() * Jb;
+      const Eigen::Vector3d gp = prior_information * offset + Ja.transpose() * residual;
+      const Eigen::LLT<Eigen::Matrix3d> llt(Hpp);
+      information -= Hpq.transpose() * llt.solve(Hpq);
+      gradient -= Hpq.transpose() * llt.solve(gp);
+    }
+  }
+  prior_pose_ = next;
+  prior_factor_ = odometry;
+  prior_mean_ = pose(next);
+  const Eigen::LLT<Eigen::Matrix3d> llt(information);
+  if (llt.info() != Eigen::Success) {
+    // без одометрии между положениями цепочка прерывается, априорной информации нет
+    prior_sqrt_information_.setZero();
+    return;
+  }
+  // среднее - минимум маргинальной задачи, один шаг Гаусса-Ньютона от текущей оценки
+  prior_mean_ -= llt.solve(gradient);
+  prior_mean_(2) = normalize_angle(prior_mean_(2));
+  prior_sqrt_information_ = llt.matrixU();
+}
+
+void PoseGraph::start_pass()
+{
+  keyframes_since_optimize_ = 0;
+  // копируются только переменные и факторы, буферы решения у копии свои
+  pass_.reset(new PoseGraph(window_, relinearize_interval_, relinearize_budget_, iterations_));
+  pass_->values_ = values_;
+  pass_->variables_ = variables_;
+  pass_->factors_ = factors_;
+  pass_->pose_variables_ = pose_variables_;
+  pass_->landmark_variables_ = landmark_variables_;
+  pass_->landmark_information_ = landmark_information_;
+  pass_start_ = values_;
+  pass_done_ = false;
+  PoseGraph* pass = pass_.get();
+  std::atomic<bool>* done = &pass_done_;
+  pass_thread_ = std::thread([pass, done]() {
+    pass->optimize();
+    *done = true;
+  });
+}
+
+void PoseGraph::finish_pass()
+{
+  pass_thread_.join();
+  const PoseGraph& pass = *pass_;
+  // переменные из копии сдвигаются на поправку полного прохода, уточнения окна за время прохода
+  // сохраняются. Переменные, добавленные позже, переносятся вместе с последним положением копии
+  const std::size_t last = pass.pose_variables_.back();
+  const double* before = &pass_start_[variables_[last].offset];
+  const double* after = &pass.values_[variables_[last].offset];
+  const double rotation = normalize_angle(after[2] - before[2]);
+  const double c = std::cos(rotation);
+  const double s = std::sin(rotation);
+  const Eigen::Vector3d prior_pose = pose(prior_pose_);
+  updated_landmarks_.clear();
+  for (std::size_t v = 0; v < variables_.size(); ++v) {
+    const Variable& variable = variables_[v];
+    double* value = &values_[variable.offset];
+    if (v < pass.variables_.size()) {
+      for (int i = 0; i < variable.dim; ++i) {
+        value[i] += pass.values_[variable.offset + i] - pass_start_[variable.offset + i];
+      }
+    } else {
+      const double dx = value[0] - before[0];
+      const double dy = value[1] - before[1];
+      value[0] = after[0] + c * dx - s * dy;
+      value[1] = after[1] + s * dx + c * dy;
+      if (variable.dim == 3) {
+        value[2] += rotation;
+      }
+    }
+    if (variable.dim == 3) {
+      value[2] = normalize_angle(value[2]);
+    } else {
+      updated_landmarks_.push_back(variable.index);
+    }
+  }
+  // априорный фактор окна сдвигается вместе со своим положением
+  Eigen::Vector3d shift = pose(prior_pose_) - prior_pose;
+  shift(2) = normalize_angle(shift(2));
+  prior_mean_ += shift;
+  prior_mean_(2) = normalize_angle(prior_mean_(2));
+  refold_observations();
+  pass_.reset();
+}
+
+void PoseGraph::update()
+{
+  // положения, вышедшие из окна, маргинализуются: априорный фактор переходит
+  // к самому старому положению окна
+  const std::size_t first = pose_count() > window_ ? pose_count() - window_ : 0;
+  while (prior_pose_ < first) {
+    advance_prior();
+  }
+  // последние положения, кроме закрепленного первого, и все наблюдаемые из них маяки
+  ++stamp_;
+  system_variables_.clear();
+  for (std::size_t p = first; p < pose_count(); ++p) {
+    if (p > 0) {
+      system_variables_.push_back(pose_variables_[p]);
+    }
+    for (std::size_t f : variables_[pose_variables_[p]].factors) {
+      Variable& landmark = variables_[factors_[f].b];
+      if (factors_[f].dim == 2 && landmark.stamp != stamp_) {
+        landmark.stamp = stamp_;
+        system_variables_.push_back(factors_[f].b);
+      }
+    }
+  }
+  solve(false);
+
+  if (pass_ && pass_done_) {
+    finish_pass();
+  }
+  if (!pass_ && ++keyframes_since_optimize_ >= std::max(relinearize_interval_, variables_.size() / relinearize_budget_)) {
+    start_pass();
+  }
+}
+
+void PoseGraph::optimize()
+{
+  if (pass_) {
+    finish_pass();
+  }
+  keyframes_since_optimize_ = 0;
+  system_variables_.clear();
+  for (std::size_t v = 0; v < variables_.size(); ++v) {
+    if (pose_variables_.empty() || v != pose_variables_.front()) {
+      system_variables_.push_back(v);
+    }
+  }
+  solve(true);
+  refold_observations();
+}
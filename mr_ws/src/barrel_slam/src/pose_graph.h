@@ -0,0 +1,181 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+#include <Eigen/StdVector>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Граф положений робота и маяков с инкрементальным решателем Гаусса-Ньютона
+ *
+ * Переменные графа - положения робота в ключевых кадрах (x, y, угол) и маяки (x, y),
+ * факторы - перемещение по одометрии между соседними положениями и измерения маяков
+ * по дальности и пеленгу. Первое положение закреплено и задает СК карты.
+ *
+ * update() после добавления ключевого кадра уточняет только окно из window последних положений
+ * и наблюдаемые из него маяки, остальные переменные считаются известными, поэтому стоимость
+ * шага не зависит от размера карты. Положения, выходящие из окна, исключаются маргинализацией
+ * цепочки одометрии: самое старое положение окна не привязано жестко к предыдущему, а получает
+ * априорный фактор с накопленной ковариацией, фактор одометрии от предыдущего положения в окно
+ * не входит. Измерения маяков из вышедшего положения переносятся в априорную информацию маяка,
+ * линеаризованную в текущих оценках, так что окно решает только измерения из своих положений и
+ * число факторов шага не растет с числом повторных наблюдений маяка. Раз в relinearize_interval кадров все факторы перелинеаризуются и решается полная
+ * задача. Период полного прохода растет с размером графа, так что в среднем на кадр приходится
+ * не больше relinearize_budget его переменных. Полный проход из update() выполняется в отдельном
+ * потоке над копией графа, а его поправки переносятся на граф в одном из следующих update():
+ * update() не решает полную задачу, а только копирует граф и складывает поправки за O(n).
+ * Нормальные уравнения решаются разреженным LDL^T. Структура матрицы и символьный анализ
+ * (упорядочение и дерево исключения) строятся один раз на решение и переиспользуются
+ * на итерациях Гаусса-Ньютона, на которых меняются только значения.
+ */
+class PoseGraph
+{
+public:
+  // window - число положений в окне инкрементального шага,
+  // relinearize_interval - наименьший период полного прохода в ключевых кадрах,
+  // relinearize_budget - среднее число переменных полного прохода на ключевой кадр,
+  // iterations - наибольшее число итераций Гаусса-Ньютона на одно решение
+  PoseGraph(std::size_t window, std::size_t relinearize_interval, std::size_t relinearize_budget,
+            std::size_t iterations);
+  ~PoseGraph();
+  PoseGraph(const PoseGraph&) = delete;
+  PoseGraph& operator=(const PoseGraph&) = delete;
+
+  // Добавление переменных с начальной оценкой, возвращается индекс положения или маяка
+  std::size_t add_pose(const Eigen::Vector3d& pose);
+  std::size_t add_landmark(const Eigen::Vector2d& landmark);
+  // Перемещение delta из положения from в положение to в СК from с ковариацией covariance
+  void add_odometry(std::size_t from, std::size_t to, const Eigen::Vector3d& delta, const Eigen::Matrix3d& covariance);
+  // Измерение маяка (дальность, пеленг) из положения pose с ковариацией covariance
+  void add_observation(std::size_t pose, std::size_t landmark, const Eigen::Vector2d& measurement,
+                       const Eigen::Matrix2d& covariance);
+
+  // Уточнение оценок после добавления ключевого кадра: окно последних положений,
+  // когда подошел период - запуск полного прохода в фоне, когда он закончен - перенос его поправок
+  void update();
+  // Полный проход: перелинеаризация всех факторов и решение задачи по всем переменным
+  // в вызывающем потоке, идущий в фоне проход предварительно дожидается
+  void optimize();
+
+  std::size_t pose_count() const { return pose_variables_.size(); }
+  std::size_t landmark_count() const { return landmark_variables_.size(); }
+  Eigen::Vector3d pose(std::size_t i) const;
+  Eigen::Vector2d landmark(std::size_t i) const;
+  // Ковариация маяка при известных положениях робота - обратная к информации его измерений
+  Eigen::Matrix2d landmark_covariance(std::size_t i) const;
+  // Маяки, оценки которых уточнялись при последнем update() или optimize()
+  const std::vector<std::size_t>& updated_landmarks() const { return updated_landmarks_; }
+  // Число неизвестных в последней решенной системе
+  std::size_t last_system_size() const { return last_system_size_; }
+  // Число факторов в последней решенной системе
+  std::size_t last_system_factors() const { return system_factors_.size(); }
+
+private:
+  struct Variable
+  {
+    // смещение оценки в values_ и размерность: 3 - положение, 2 - маяк
+    std::size_t offset;
+    int dim;
+    // индекс положения или маяка
+    std::size_t index;
+    // факторы, в которых участвует переменная. У маяка - только измерения из положений окна,
+    // измерения из вышедших положений перенесены в marginalized_factors
+    std::vector<std::size_t> factors;
+    std::vector<std::size_t> marginalized_factors;
+    // первый столбец в решаемой системе, -1 - переменная не решается
+    Eigen::Index column = -1;
+    // номер выборки, в которую переменная уже включена
+    std::size_t stamp = 0;
+  };
+
+  struct Factor
+  {
+    // положение и второе положение (одометрия) или маяк (измерение)
+    std::size_t a, b;
+    // размерность невязки: 3 - одометрия, 2 - измерение маяка
+    int dim;
+    Eigen::Vector3d measurement;
+    // верхнетреугольный множитель информационной матрицы W, W^T * W = ковариация^-1
+    Eigen::Matrix3d sqrt_information;
+    // номер решения, в которое фактор уже включен
+    std::size_t stamp = 0;
+  };
+
+  // невязка и якобианы фактора не больше 3x3
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 1, 0, 3, 1> Residual;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, 3, 3> Jacobian;
+
+  std::size_t add_variable(int dim, std::size_t index, const double* value);
+  std::size_t add_factor(const Factor& factor);
+  // Выбеленные невязка и якобианы фактора в текущих оценках
+  void linearize(const Factor& factor, Residual& residual, Jacobian& Ja, Jacobian& Jb) const;
+  // Блок block нормальной матрицы для пары переменных, хранится нижний треугольник
+  void add_block(const Variable& row, const Variable& col, const Jacobian& block);
+  // Сборка нормальных уравнений H * delta = -g по факторам system_factors_.
+  // При reuse_structure структура H берется с прошлой итерации, меняются только значения,
+  // при full используются все факторы, иначе - априорная информация маяков вместо измерений вне окна
+  void build_system(Eigen::Index size, bool reuse_structure, bool full);
+  // Гаусс-Ньютон по переменным system_variables_, остальные переменные фиксированы
+  void solve(bool full);
+  // Перенос априорного фактора на следующее положение маргинализацией текущего,
+  // измерения маяков из текущего положения переходят в априорную информацию маяков
+  void advance_prior();
+  // Добавление измерения f в априорную информацию его маяка в точке текущих оценок
+  void fold_observation(std::size_t f);
+  // Перелинеаризация априорной информации всех маяков в текущих оценках
+  void refold_observations();
+  // Запуск полного прохода в фоне над копией графа
+  void start_pass();
+  // Ожидание фонового прохода и перенос его поправок на граф
+  void finish_pass();
+
+  std::size_t window_;
+  std::size_t relinearize_interval_;
+  std::size_t relinearize_budget_;
+  std::size_t iterations_;
+
+  // оценки всех переменных подряд, смещения переменных задаются offset
+  std::vector<double> values_;
+  std::vector<Variable> variables_;
+  std::vector<Factor> factors_;
+  std::vector<std::size_t> pose_variables_;
+  std::vector<std::size_t> landmark_variables_;
+  // информация маяков при известных положениях робота, обновляется при каждом решении
+  std::vector<Eigen::Matrix2d, Eigen::aligned_allocator<Eigen::Matrix2d>> landmark_information_;
+  // априорная информация маяков по измерениям из вышедших из окна положений:
+  // стоимость 0.5 * x^T * A * x - b^T * x, A - информация, b = A * среднее
+  std::vector<Eigen::Matrix2d, Eigen::aligned_allocator<Eigen::Matrix2d>> landmark_prior_information_;
+  std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> landmark_prior_vector_;
+
+  // априорный фактор самого старого положения окна prior_pose_ (0 - нет, первое положение закреплено):
+  // среднее, верхнетреугольный множитель информации и заменяемый им фактор одометрии
+  std::size_t prior_pose_ = 0;
+  Eigen::Vector3d prior_mean_;
+  Eigen::Matrix3d prior_sqrt_information_;
+  std::size_t prior_factor_ = 0;
+  std::size_t keyframes_since_optimize_ = 0;
+  std::size_t stamp_ = 0;
+  std::size_t last_system_size_ = 0;
+  std::vector<std::size_t> updated_landmarks_;
+
+  // буферы решения
+  std::vector<std::size_t> system_variables_;
+  std::vector<std::size_t> system_factors_;
+  std::vector<Eigen::Triplet<double>> triplets_;
+  std::vector<Eigen::Index> triplet_positions_;
+  Eigen::SparseMatrix<double> H_;
+  Eigen::VectorXd g_;
+  Eigen::VectorXd delta_;
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> ldlt_;
+
+  // фоновый полный проход: копия графа, оценки на момент копирования и поток решения
+  std::unique_ptr<PoseGraph> pass_;
+  std::vector<double> pass_start_;
+  std::thread pass_thread_;
+  std::atomic<bool> pass_done_{false};
+};
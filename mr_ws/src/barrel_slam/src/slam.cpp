@@ -1,120 +1,268 @@
 #include "slam.h"
 #include <angles/angles.h>
 #include <sstream>
+#include <algorithm>
+#include <limits>
 #include <math.h>
 
 
-void Slam::on_odo(const nav_msgs::Odometry& odom)
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::on_odo(const nav_msgs::Odometry& odom)
 {
-  v = odom.twist.twist.linear.x;
-  w = odom.twist.twist.angular.z;
+  std::lock_guard<std::mutex> lock(odometry_mutex);
+  odometry.push(odom.header.stamp.toSec(), odom.twist.twist.linear.x, odom.twist.twist.angular.z);
 }
 
-void Slam::add_landmark(const sensor_msgs::LaserScan& scan, std::size_t start, std::size_t finish)
+template <int MaxLandmarks>
+Eigen::Vector3d Slam<MaxLandmarks>::odometry_motion(const ros::Time& stamp)
 {
-  // Добавляем только особые точки, на которые попало более 2 лучей
-  if (finish - start < 2) {
+  std::lock_guard<std::mutex> lock(odometry_mutex);
+  return odometry.motion(last_time.toSec(), stamp.toSec());
+}
+
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::add_landmark(std::size_t start, std::size_t finish)
+{
+  // центр маяка - центр окружности, проведенной через точки кластера, нужно не менее 3 точек
+  circle_fit::Circle circle;
+  if (finish - start < 3 ||
+      !circle_fit::fit(scan_x.data() + start, scan_y.data() + start, finish - start, circle)) {
+    return;
+  }
+  // кластеры другого радиуса - не маяки
+  if (std::abs(circle.radius - feature_rad) > feature_radius_tolerance * feature_rad) {
     return;
   }
-  // TODO Здесь должен быть код определения координаты центра круглого препятствия 
 
-  double x = 0.0, y = 0.0;
+  // Добавляем координаты особой точки относительно лазера и ее измерение (дальность, пеленг)
+  new_landmarks.push_back(circle.center);
+  new_landmarks_measurement.push_back(Eigen::Vector2d(circle.center.norm(),
+                                                      atan2(circle.center.y(), circle.center.x())));
+}
 
-  // Вычисляем среднее расстояние и угол для определения центра круглого препятствия
-  double pointDist = 0.0;
-  double pointAngle = 0.0;
-  int total = 0;
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::detect_landmarks(const sensor_msgs::LaserScan& scan)
+{
+  new_landmarks.clear();
+  new_landmarks_measurement.clear();
 
-  for (size_t idx = start; idx < finish; ++idx) {
-    if (scan.ranges[idx] >= scan.range_max) {
-      continue;
+  // точки скана в СК дальномера, синусы и косинусы углов лучей берутся из кеша
+  const simple_map::BeamDirections& directions = beam_directions.get(scan);
+  simple_map::ranges_to_points(directions, scan.ranges, scan_x, scan_y);
+
+  // один проход по лучам: луч замыкает кластер, если он или следующий луч без отражения
+  // (дальше range_max - 1 или ближе range_min), или следующая точка дальше feature_rad.
+  // Сравнения с NaN ложны, поэтому лучи с NaN тоже без отражения
+  const std::size_t count = scan.ranges.size();
+  const float max_range = scan.range_max - 1.0f;
+  const float gap_sqr = feature_rad * feature_rad;
+  std::size_t start = 0;
+  for (std::size_t index = 0; index < count; ++index) {
+    const std::size_t next = index + 1;
+    bool closes = next == count;
+    if (!closes) {
+      const float dx = scan_x[next] - scan_x[index];
+      const float dy = scan_y[next] - scan_y[index];
+      const float range = scan.ranges[index];
+      const float next_range = scan.ranges[next];
+      closes = !(range >= scan.range_min) | !(range <= max_range) |
+               !(next_range >= scan.range_min) | !(next_range <= max_range) |
+               !(dx * dx + dy * dy < gap_sqr);
+    }
+    if (closes) {
+      // кластеры из одного луча без отражения отбрасываются в add_landmark по числу точек
+      add_landmark(start, next);
+      start = next;
     }
-    pointAngle += idx * scan.angle_increment - M_PI_2;
-    pointDist += scan.ranges[idx];
-    total++;
   }
-
-  // Рассчитываем средний угол и расстояние
-  pointAngle /= total;
-  pointDist /= total;
-  pointDist += feature_rad; // Добавляем радиус для получения центра круглого препятствия
-
-  // Вычисляем координаты особой точки относительно лазера
-  x = pointDist * cos(pointAngle);
-  y = pointDist * sin(pointAngle);
-
-  // Добавляем координаты особой точки в вектор особых точек
-  new_landmarks.push_back(Eigen::Vector2d(x, y));
-  new_landmarks_measurement.push_back(Eigen::Vector2d(pointDist, pointAngle));
 }
 
-void Slam::detect_landmarks(const sensor_msgs::LaserScan& scan)
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::update_landmark_grid()
 {
-  new_landmarks.clear();
-  new_landmarks_measurement.clear();
+  // перекладываются только маяки, перешедшие в другую ячейку, остальные move не трогает
+  for (std::size_t i = 0; i < landmarks_found_quantity; ++i) {
+    const Eigen::Vector2d landmark = X.template segment<2>(ROBOT_STATE_SIZE + i * 2);
+    landmark_grid.move(i, grid_positions[i], landmark);
+    grid_positions[i] = landmark;
+  }
+}
 
-  // TODO Здесь должен быть код для пределения особенные точек скана
-  // ищем начальный и конечный индексы лучей, падающих на одно препятствие
-  // и вызываем add_landmark
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::observation_model(int landmarkIndex, Eigen::Vector2d& measurementPred,
+                             Eigen::Matrix<double, 2, 3>& Gi_x, Eigen::Matrix2d& Gi_m) const
+{
+  double x = X(0);
+  double y = X(1);
+  double theta = X(2);
+  double mi_x = X(ROBOT_STATE_SIZE + landmarkIndex * 2);
+  double mi_y = X(ROBOT_STATE_SIZE + landmarkIndex * 2 + 1);
 
-  size_t index = 0;
+  // Рассчитываем предсказанное измерение
+  double dist2 = pow(mi_x - x, 2.0) + pow(mi_y - y, 2.0);
+  double dist = sqrt(dist2);
+  double x_mi_x = x - mi_x;
+  double y_mi_y = y - mi_y;
+  measurementPred << dist, angles::normalize_angle(atan2(-y_mi_y, -x_mi_x) - theta);
 
-  while (index < scan.ranges.size()) {
-    // Пропускаем значения, которые превышают максимальное расстояние
-    if (scan.ranges[index] > scan.range_max - 1.0) {
-      ++index;
-    }
-    // Если разница между текущим и следующим лучом меньше порога feature_rad,
-    // считаем это за начало объекта, далее ищем его окончание
-    else if (std::abs(scan.ranges[index] - scan.ranges[index + 1]) < feature_rad) {
-      size_t end_index = index + 1;
-
-      while (std::abs(scan.ranges[end_index] - scan.ranges[end_index + 1]) < feature_rad &&
-             end_index < scan.ranges.size() - 1) {
-        ++end_index;
-      }
+  // Вычисляем якобианы
+  Gi_x << (x_mi_x / dist), (y_mi_y / dist), 0,
+          (-y_mi_y / dist2), (x_mi_x / dist2), -1;
 
-      // Вызываем add_landmark для обнаруженного объекта
-      add_landmark(scan, index, end_index);
-      index = end_index + 1;
-    }
-    else {
-      // Если разница между текущим и следующим лучом больше порога feature_rad,
-      // продолжаем поиск следующего объекта
-      ++index;
-    }
+  Gi_m << (-x_mi_x / dist), (-y_mi_y / dist),
+          (y_mi_y / dist2), (-x_mi_x / dist2);
+}
 
-    // Проверка на выход за границы массива
-    if (index >= scan.ranges.size()) {
-      break;
-    }
+template <int MaxLandmarks>
+Eigen::Matrix2d Slam<MaxLandmarks>::innovation_covariance(int landmarkIndex, const Eigen::Matrix<double, 2, 3>& Gi_x,
+                                            const Eigen::Matrix2d& Gi_m) const
+{
+  const std::size_t mi = ROBOT_STATE_SIZE + landmarkIndex * 2;
+  if (use_graph) {
+    // в графе нет связей робота с маяками: неопределенность перемещения от ключевого кадра
+    // и ковариация маяка при известных положениях робота
+    return Gi_x * P.template topLeftCorner<ROBOT_STATE_SIZE, ROBOT_STATE_SIZE>() * Gi_x.transpose()
+         + Gi_m * graph.landmark_covariance(landmarkIndex) * Gi_m.transpose() + Q;
   }
+  if (square_root) {
+    return square_root_ekf::innovation_covariance(P_sqrt, Gi_x, Gi_m, mi, Q);
+  }
+  // Gi_x * Pxm * Gi_m^T и симметричное ему слагаемое
+  const Eigen::Matrix2d cross = Gi_x * P.template block<ROBOT_STATE_SIZE, 2>(0, mi) * Gi_m.transpose();
+  return Gi_x * P.template topLeftCorner<ROBOT_STATE_SIZE, ROBOT_STATE_SIZE>() * Gi_x.transpose()
+       + cross + cross.transpose()
+       + Gi_m * P.template block<2, 2>(mi, mi) * Gi_m.transpose() + Q;
 }
 
-int Slam::associate_measurement(const Eigen::Vector2d& landmark_measurement) {
-  double nearest_distance = 1e10;
-  int nearest_index = -1;
+template <int MaxLandmarks>
+double Slam<MaxLandmarks>::compatible_landmarks(int measurementIndex, AssociationPairs& pairs)
+{
   // преобразование от СК карты к СК робота (дальномера)
   Eigen::Isometry2d robot_to_map = Eigen::Translation2d(X.segment(0, 2))
                                  * Eigen::Rotation2Dd(X(2));
-  for (std::size_t i = 0; i < landmarks_found_quantity; ++i) {
-    double distance = (robot_to_map * landmark_measurement - X.segment(ROBOT_STATE_SIZE + i*2, 2)).norm();
-    if (distance < nearest_distance) {
-      nearest_index = i;
-      nearest_distance = distance;
+  const Eigen::Vector2d measurement_in_map = robot_to_map * new_landmarks[measurementIndex];
+  const Eigen::Vector2d& measurement = new_landmarks_measurement[measurementIndex];
+
+  // кандидаты - маяки вблизи измерения, остальные заведомо не проходят порог
+  association_candidates.clear();
+  landmark_grid.query(measurement_in_map, association_radius, association_candidates);
+
+  pairs.clear();
+  double nearest_distance = std::numeric_limits<double>::infinity();
+  AssociationPair pair;
+  Eigen::Vector2d measurementPred;
+  for (int i : association_candidates) {
+    observation_model(i, measurementPred, pair.Gi_x, pair.Gi_m);
+    pair.innovation = measurement - measurementPred;
+    pair.innovation(1) = angles::normalize_angle(pair.innovation(1));
+    // квадрат расстояния Махаланобиса nu^T * S^-1 * nu
+    pair.distance = pair.innovation.dot(
+        innovation_covariance(i, pair.Gi_x, pair.Gi_m).ldlt().solve(pair.innovation));
+    nearest_distance = std::min(nearest_distance, pair.distance);
+    if (pair.distance < association_gate) {
+      pair.landmark = i;
+      pair.offset = ROBOT_STATE_SIZE + i * 2;
+      pairs.push_back(pair);
+    }
+  }
+  std::sort(pairs.begin(), pairs.end(), [](const AssociationPair& a, const AssociationPair& b) {
+    return a.distance < b.distance;
+  });
+  return nearest_distance;
+}
+
+template <int MaxLandmarks>
+int Slam<MaxLandmarks>::unassociated_measurement(double nearest_distance) const
+{
+  if (nearest_distance < new_landmark_gate) {
+    return AMBIGUOUS_MEASUREMENT;
+  }
+  return NEW_LANDMARK;
+}
+
+template <int MaxLandmarks>
+int Slam<MaxLandmarks>::associate_measurement(int measurementIndex) {
+  const double nearest_distance = compatible_landmarks(measurementIndex, association_pairs);
+  if (!association_pairs.empty()) {
+    return association_pairs.front().landmark;
+  }
+  return unassociated_measurement(nearest_distance);
+}
+
+template <int MaxLandmarks>
+Eigen::Matrix3d Slam<MaxLandmarks>::robot_covariance() const
+{
+  if (square_root) {
+    const Eigen::Matrix3d L00 = P_sqrt.template topLeftCorner<ROBOT_STATE_SIZE, ROBOT_STATE_SIZE>();
+    return L00 * L00.transpose();
+  }
+  return P.template topLeftCorner<ROBOT_STATE_SIZE, ROBOT_STATE_SIZE>();
+}
+
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::associate_jcbb()
+{
+  const std::size_t m = new_landmarks.size();
+  if (square_root) {
+    // JCBB нужны произвольные блоки P, в режиме square_root P восстанавливается по множителю, O(n^3)
+    const std::size_t n = state_size();
+    auto L = P_sqrt.topLeftCorner(n, n);
+    P.topLeftCorner(n, n).noalias() = L.template triangularView<Eigen::Lower>() * L.transpose();
+  }
+  // списки пар не укорачиваются, чтобы сохранить выделенную под них память
+  if (jcbb_candidates.size() < m) {
+    jcbb_candidates.resize(m);
+  }
+  jcbb_nearest_distance.resize(m);
+  for (std::size_t i = 0; i < m; ++i) {
+    jcbb_nearest_distance[i] = compatible_landmarks(i, jcbb_candidates[i]);
+  }
+  jcbb.associate(P, Q, landmarks_found_quantity, jcbb_candidates, m, associations);
+  for (std::size_t i = 0; i < m; ++i) {
+    if (associations[i] < 0) {
+      associations[i] = unassociated_measurement(jcbb_nearest_distance[i]);
     }
   }
-  // naive association
-  const double kAssocThreshold = 5.0;
-  if (nearest_index >= 0 && nearest_distance < kAssocThreshold) {
-    return nearest_index;
+}
+
+template <int MaxLandmarks>
+bool Slam<MaxLandmarks>::reserve_landmarks(std::size_t count)
+{
+  const std::size_t capacity = (X.size() - ROBOT_STATE_SIZE) / 2;
+  if (count <= capacity) {
+    return true;
+  }
+  // место в матрицах фиксированной емкости выделено сразу на MaxLandmarks маяков
+  if (MaxLandmarks != Eigen::Dynamic) {
+    return false;
+  }
+  // удвоение запаса: перевыделение памяти происходит O(log n) раз за все время работы
+  const std::size_t old_size = X.size();
+  const std::size_t new_size = ROBOT_STATE_SIZE + 2 * std::max(count, 2 * capacity);
+  X.conservativeResize(new_size);
+  X.tail(new_size - old_size).setZero();
+  // в режимах графа и FastSLAM ковариация маяков в P не хранится
+  if (use_graph || use_fastslam) {
+    return true;
   }
-  return -1;
+  P.conservativeResize(new_size, new_size);
+  P.rightCols(new_size - old_size).setZero();
+  P.bottomRows(new_size - old_size).setZero();
+  P_sqrt.conservativeResize(new_size, new_size);
+  P_sqrt.rightCols(new_size - old_size).setZero();
+  P_sqrt.bottomRows(new_size - old_size).setZero();
+  return true;
 }
 
-int Slam::add_landmark_to_state(int measurementIndex)
+template <int MaxLandmarks>
+int Slam<MaxLandmarks>::add_landmark_to_state(int measurementIndex)
 {
+  if (!reserve_landmarks(landmarks_found_quantity + 1)) {
+    ROS_ERROR_STREAM_THROTTLE(1.0, "landmark capacity " << MaxLandmarks << " is exhausted, new landmark is dropped");
+    return -1;
+  }
   ++landmarks_found_quantity;
+  advertize_landmark_publishers();
 
   // TODO init landmark in state
   // Здесь должен быть код по инициализации части вектора состояния, соответствующей 
@@ -132,6 +280,8 @@ int Slam::add_landmark_to_state(int measurementIndex)
   // Обновляем состояния для нового маяка
   X[ROBOT_STATE_SIZE + 2 * landmarks_found_quantity - 2] = newLandmark[0];
   X[ROBOT_STATE_SIZE + 2 * landmarks_found_quantity - 1] = newLandmark[1];
+  landmark_grid.insert(landmarks_found_quantity - 1, newLandmark);
+  grid_positions.push_back(newLandmark);
 
   int landmarkIndex = landmarks_found_quantity;
   double x = X(0);
@@ -145,12 +295,13 @@ int Slam::add_landmark_to_state(int measurementIndex)
   // Записываем результат ковариации (мера взаимосвязи двух случайных величин,
   // измеряющая общее отклонение двух случайных величин от их ожидаемых значений.
   // Метрика оценивает, в какой степени переменные изменяются вместе.)
-  double pmxx = P(0, 0);
-  double pmxy = P(0, 1);
-  double pmxt = P(0, 2);
-  double pmyy = P(1, 1);
-  double pmyt = P(1, 2);
-  double pmtt = P(2, 2);
+  const Eigen::Matrix3d Prr = robot_covariance();
+  double pmxx = Prr(0, 0);
+  double pmxy = Prr(0, 1);
+  double pmxt = Prr(0, 2);
+  double pmyy = Prr(1, 1);
+  double pmyt = Prr(1, 2);
+  double pmtt = Prr(2, 2);
 
   double dr = Q(0, 0);
   double dphi = Q(0, 0);
@@ -173,8 +324,28 @@ int Slam::add_landmark_to_state(int measurementIndex)
   PLi(1, 0) = PLi(0, 1);
   PLi(1, 1) += s_zt * s_zt * dr + pow(zi_r * c_zt, 2.) * dphi;
 
-  // Обновляем значение постериорной (прошлой) ковариации
-  P.block(ROBOT_STATE_SIZE + landmarkIndex * 2 - 2, ROBOT_STATE_SIZE + landmarkIndex * 2 - 2, 2, 2) = PLi;
+  // Обновляем значение постериорной (прошлой) ковариации, связь нового маяка
+  // с остальным состоянием не учитывается
+  const std::size_t li = ROBOT_STATE_SIZE + landmarkIndex * 2 - 2;
+  if (use_graph) {
+    // маяк становится переменной графа с фактором первого измерения из текущего ключевого кадра
+    graph.add_landmark(newLandmark);
+    graph.add_observation(graph.pose_count() - 1, landmarks_found_quantity - 1,
+                          new_landmarks_measurement[measurementIndex], Q);
+  } else if (square_root) {
+    // при нулевой связи с остальным состоянием строки множителя маяка - множитель PLi
+    P_sqrt.middleRows(li, 2).setZero();
+    P_sqrt.middleCols(li, 2).setZero();
+    Eigen::Matrix2d PLi_sqrt;
+    if (!square_root_ekf::factor(PLi, 1e-9, PLi_sqrt)) {
+      ROS_WARN("Landmark covariance is not positive definite, regularized");
+    }
+    P_sqrt.block(li, li, 2, 2) = PLi_sqrt;
+  } else {
+    P.middleRows(li, 2).setZero();
+    P.middleCols(li, 2).setZero();
+    P.block(li, li, 2, 2) = PLi;
+  }
 
   // Выводим информацию о добавленном маяке в состояние
    ROS_INFO("Adding landmark to state, x: %f y: %f", newLandmark[0], newLandmark[1]);
@@ -183,70 +354,250 @@ int Slam::add_landmark_to_state(int measurementIndex)
 }
 
 
-void Slam::correct(int landmarkIndex, int measurementIndex)
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::correct(int landmarkIndex, int measurementIndex)
 {
   // TODO 
   // Здесь должен быть код для обновления состояния по измерению iого маяка
 
-  // Извлекаем текущие значения состояния и измерения
-  double x = X(0);
-  double y = X(1);
-  double theta = X(2);
-  double mi_x = X(ROBOT_STATE_SIZE + landmarkIndex * 2);
-  double mi_y = X(ROBOT_STATE_SIZE + landmarkIndex * 2 + 1);
-  double zi_r = new_landmarks_measurement[measurementIndex](0);
-  double zi_phi = new_landmarks_measurement[measurementIndex](1);
+  // Рассчитываем предсказанное измерение и якобианы
+  Eigen::Vector2d measurementPred;
+  Eigen::Matrix<double, 2, 3> Gi_x;
+  Eigen::Matrix<double, 2, 2> Gi_m;
+  observation_model(landmarkIndex, measurementPred, Gi_x, Gi_m);
+  // невязка по пеленгу приводится к [-pi, pi], иначе у разрыва угла ошибка почти 2pi
+  Eigen::Vector2d innovation = new_landmarks_measurement[measurementIndex] - measurementPred;
+  innovation(1) = angles::normalize_angle(innovation(1));
+
+  if (square_root) {
+    square_root_ekf::correct(P_sqrt, X, state_size(), Gi_x, Gi_m, ROBOT_STATE_SIZE + landmarkIndex * 2,
+                             Q_sqrt, innovation);
+    return;
+  }
 
-  // Рассчитываем предсказанное измерение
-  double dist2 = pow(mi_x - x, 2.0) + pow(mi_y - y, 2.0);
-  double dist = sqrt(dist2);
-  double x_mi_x = x - mi_x;
-  double y_mi_y = y - mi_y;
-  double zi_r_pred = dist;
-  double zi_phi_pred = angles::normalize_angle(atan2(-y_mi_y, -x_mi_x) - theta);
-  Eigen::Vector2d measurementPred(zi_r_pred, zi_phi_pred);
+  // Полный якобиан Gi = [Gi_x 0 .. 0 Gi_m 0 .. 0] не строим: ненулевые в нем только столбцы
+  // робота и маяка, поэтому все произведения с Gi собираются из этих блоков
+  const std::size_t mi = ROBOT_STATE_SIZE + landmarkIndex * 2;
 
-  // Вычисляем якобианы
-  Eigen::Matrix<double, 2, 3> Gi_x;
-  Gi_x << (x_mi_x / dist), (y_mi_y / dist), 0,
-          (-y_mi_y / dist2), (x_mi_x / dist2), -1;
+  // в вычислениях участвует только активная часть состояния
+  const std::size_t n = state_size();
+  auto Pa = P.topLeftCorner(n, n);
 
-  Eigen::Matrix<double, 2, 2> Gi_m;
-  Gi_m << (-x_mi_x / dist), (-y_mi_y / dist),
-          (y_mi_y / dist2), (-x_mi_x / dist2);
+  // P * Gi^T - сумма двух блоков столбцов P, O(n)
+  Gain PGt =
+      Pa.template leftCols<ROBOT_STATE_SIZE>() * Gi_x.transpose() + Pa.template middleCols<2>(mi) * Gi_m.transpose();
 
-  Eigen::Matrix<double, 2, ROBOT_STATE_SIZE + NUMBER_LANDMARKS * 2> Gi;
-  Gi.setZero();
-  Gi.block(0, 0, 2, 3) = Gi_x;
-  Gi.block(0, ROBOT_STATE_SIZE + landmarkIndex * 2, 2, 2) = Gi_m;
+  // Вычисляем временную матрицу (ковариацию невязки) Gi * P * Gi^T + Q по строкам робота и маяка
+  Eigen::Matrix<double, 2, 2> tempMat =
+      Gi_x * PGt.template topRows<ROBOT_STATE_SIZE>() + Gi_m * PGt.template middleRows<2>(mi) + Q;
 
-  // Вычисляем временную матрицу и корректирующую матрицу Калмана
-  Eigen::Matrix<double, 2, 2> tempMat;
-  tempMat = Gi * P * Gi.transpose() + Q;
+  // корректирующая матрица Калмана
+  Gain K = PGt * tempMat.inverse();
 
-  Eigen::Matrix<double, ROBOT_STATE_SIZE + NUMBER_LANDMARKS * 2, 2> K;
-  K.setZero();
-  K = P * Gi.transpose() * tempMat.inverse();
+  // Обновляем матрицу ковариации и вектор состояния.
+  // (I - K * Gi) * P = P - K * Gi * P = P - K * (P * Gi^T)^T - симметричное понижение ранга 2, O(n^2)
+  Pa.noalias() -= K * PGt.transpose();
+  X.head(n) += K * innovation;
+}
 
-  // Обновляем матрицу ковариации и вектор состояния
-  P = (Eigen::Matrix<double, ROBOT_STATE_SIZE + NUMBER_LANDMARKS * 2, ROBOT_STATE_SIZE + NUMBER_LANDMARKS * 2>::Identity() - K * Gi) * P;
-  X = X + K * (new_landmarks_measurement[measurementIndex] - measurementPred);
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::correct_batch()
+{
+  if (square_root) {
+    // последовательные коррекции множителя по измерениям эквивалентны одной пакетной
+    for (const auto& association : batch_associations) {
+      correct(association.first, association.second);
+    }
+    return;
+  }
+  const std::size_t m = std::min(batch_associations.size(), std::size_t(max_batch_measurements));
+  if (m == 0) {
+    return;
+  }
+  const std::size_t n = state_size();
+  auto Pa = P.topLeftCorner(n, n);
+
+  // Совместный якобиан H (2m x n) не строим, как и в correct: у каждого измерения ненулевые
+  // только блоки робота и своего маяка. Сохраняем их для сборки S
+  batch_Gx.resize(2 * m, ROBOT_STATE_SIZE);
+  batch_Gm.resize(2 * m, 2);
+  batch_PHt.resize(n, 2 * m);
+  batch_innovation.resize(2 * m);
+  Eigen::Vector2d measurementPred;
+  Eigen::Matrix<double, 2, 3> Gi_x;
+  Eigen::Matrix2d Gi_m;
+  for (std::size_t a = 0; a < m; ++a) {
+    const int landmarkIndex = batch_associations[a].first;
+    const std::size_t mi = ROBOT_STATE_SIZE + landmarkIndex * 2;
+    observation_model(landmarkIndex, measurementPred, Gi_x, Gi_m);
+    batch_Gx.template middleRows<2>(2 * a) = Gi_x;
+    batch_Gm.template middleRows<2>(2 * a) = Gi_m;
+    Eigen::Vector2d innovation = new_landmarks_measurement[batch_associations[a].second] - measurementPred;
+    innovation(1) = angles::normalize_angle(innovation(1));
+    batch_innovation.template segment<2>(2 * a) = innovation;
+    // P * H^T по блокам столбцов, O(n) на измерение
+    batch_PHt.template middleCols<2>(2 * a) =
+        Pa.template leftCols<ROBOT_STATE_SIZE>() * Gi_x.transpose() + Pa.template middleCols<2>(mi) * Gi_m.transpose();
+  }
+
+  // S = H * P * H^T + Q по блокам 2x2: строки H_a выбирают из P * H^T строки робота и маяка a
+  batch_S.resize(2 * m, 2 * m);
+  for (std::size_t a = 0; a < m; ++a) {
+    const std::size_t mi = ROBOT_STATE_SIZE + batch_associations[a].first * 2;
+    batch_S.template middleRows<2>(2 * a) =
+        batch_Gx.template middleRows<2>(2 * a) * batch_PHt.template topRows<ROBOT_STATE_SIZE>()
+      + batch_Gm.template middleRows<2>(2 * a) * batch_PHt.template middleRows<2>(mi);
+    batch_S.template block<2, 2>(2 * a, 2 * a) += Q;
+  }
+
+  batch_llt.compute(batch_S);
+  if (batch_llt.info() != Eigen::Success) {
+    ROS_WARN_STREAM("innovation covariance is not positive definite, falling back to sequential correction");
+    for (const auto& association : batch_associations) {
+      correct(association.first, association.second);
+    }
+    return;
+  }
+  // K^T = S^-1 * (P * H^T)^T, затем P -= K * (P * H^T)^T - симметричное понижение ранга 2m, O(m n^2)
+  batch_Kt = batch_llt.solve(batch_PHt.transpose());
+  Pa.noalias() -= batch_PHt * batch_Kt;
+  X.head(n).noalias() += batch_Kt.transpose() * batch_innovation;
+  // измерения сверх емкости буферов
+  for (std::size_t a = m; a < batch_associations.size(); ++a) {
+    correct(batch_associations[a].first, batch_associations[a].second);
+  }
 }
 
-void Slam::on_scan(const sensor_msgs::LaserScan& scan) {
-  detect_landmarks(scan);
-  predict((scan.header.stamp - last_time).toSec());
-  last_time = scan.header.stamp;
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::update_graph()
+{
+  const Eigen::Vector3d pose = X.template head<ROBOT_STATE_SIZE>();
+  if (graph.pose_count() == 0) {
+    // первое положение закреплено в графе и задает СК карты
+    graph.add_pose(pose);
+  } else {
+    // перемещение от последнего ключевого кадра в его СК
+    const std::size_t previous = graph.pose_count() - 1;
+    const Eigen::Vector3d keyframe = graph.pose(previous);
+    Eigen::Matrix3d rotation = Eigen::Matrix3d::Identity();
+    rotation.topLeftCorner<2, 2>() = Eigen::Rotation2Dd(-keyframe(2)).toRotationMatrix();
+    Eigen::Vector3d delta = rotation * (pose - keyframe);
+    delta(2) = angles::normalize_angle(delta(2));
+    if (delta.head<2>().norm() < keyframe_distance && std::abs(delta(2)) < keyframe_angle) {
+      return;
+    }
+    // ковариация перемещения накоплена прогнозом в блоке робота P с прошлого ключевого кадра
+    const Eigen::Matrix3d covariance = rotation * P.template topLeftCorner<ROBOT_STATE_SIZE, ROBOT_STATE_SIZE>()
+                                     * rotation.transpose();
+    graph.add_odometry(previous, graph.add_pose(pose), delta, covariance);
+  }
+
+  const std::size_t pose_index = graph.pose_count() - 1;
   for (std::size_t i = 0; i < new_landmarks.size(); ++i) {
-    const auto landmark_index = associate_measurement(new_landmarks[i]);
+    const int landmark_index = associate_measurement(i);
     if (landmark_index >= 0) {
-      correct(landmark_index, i);
+      graph.add_observation(pose_index, landmark_index, new_landmarks_measurement[i], Q);
+    } else if (landmark_index == NEW_LANDMARK) {
+      add_landmark_to_state(i);
+    }
+  }
+  graph.update();
+
+  // оценки переносятся в X, сетка поиска обновляется только для сдвинутых маяков
+  X.template head<ROBOT_STATE_SIZE>() = graph.pose(pose_index);
+  for (std::size_t i : graph.updated_landmarks()) {
+    auto landmark = X.template segment<2>(ROBOT_STATE_SIZE + i * 2);
+    const Eigen::Vector2d estimate = graph.landmark(i);
+    landmark_grid.move(i, landmark, estimate);
+    landmark = estimate;
+  }
+  P.template topLeftCorner<ROBOT_STATE_SIZE, ROBOT_STATE_SIZE>().setZero();
+}
+
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::update_fastslam(const Eigen::Vector3d& motion)
+{
+  // кандидаты ассоциации - маяки из сетки около измерения, отложенного от оценки лучшей частицы
+  // на прошлом скане: за скан робот смещается много меньше радиуса поиска
+  Eigen::Isometry2d robot_to_map = Eigen::Translation2d(X.segment(0, 2))
+                                 * Eigen::Rotation2Dd(X(2));
+  fastslam_candidates.resize(new_landmarks.size());
+  for (std::size_t i = 0; i < new_landmarks.size(); ++i) {
+    fastslam_candidates[i].clear();
+    landmark_grid.query(robot_to_map * new_landmarks[i], association_radius, fastslam_candidates[i]);
+  }
+  fastslam->update(motion, new_landmarks_measurement, fastslam_candidates);
+
+  // оценки лучшей частицы переносятся в X только для наблюдавшихся маяков
+  const std::size_t known_landmarks = landmarks_found_quantity;
+  reserve_landmarks(fastslam->landmark_count());
+  landmarks_found_quantity = fastslam->landmark_count();
+  advertize_landmark_publishers();
+  X.template head<ROBOT_STATE_SIZE>() = fastslam->pose();
+  for (std::size_t i : fastslam->observed_landmarks()) {
+    auto landmark = X.template segment<2>(ROBOT_STATE_SIZE + i * 2);
+    const Eigen::Vector2d estimate = fastslam->landmark(i);
+    if (i < known_landmarks) {
+      landmark_grid.move(i, landmark, estimate);
     } else {
-        if (landmarks_found_quantity < NUMBER_LANDMARKS) {
-          add_landmark_to_state(i);
-        } else { 
-            ROS_ERROR_STREAM("can not associate new landmark with any existing one");
-        }
+      landmark_grid.insert(i, estimate);
+      ROS_INFO("Adding landmark to state, x: %f y: %f", estimate[0], estimate[1]);
+    }
+    landmark = estimate;
+  }
+}
+
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::on_scan(const sensor_msgs::LaserScan& scan) {
+  detect_landmarks(scan);
+  // частицы прогнозируются внутри FastSLAM, общий прогноз X и P не нужен
+  const Eigen::Vector3d motion = odometry_motion(scan.header.stamp);
+  last_time = scan.header.stamp;
+  if (use_fastslam) {
+    update_fastslam(motion);
+    publish_results("map", scan.header.stamp);
+    publish_transform(scan.header);
+    return;
+  }
+  predict(motion);
+  if (use_graph) {
+    update_graph();
+    publish_results("map", scan.header.stamp);
+    publish_transform(scan.header);
+    return;
+  }
+  // коррекции прошлого скана сдвигают все маяки, в сетке перекладываются сменившие ячейку
+  update_landmark_grid();
+  // в режиме JCBB все измерения ассоциируются до коррекций,
+  // иначе каждое измерение ассоциируется с учетом коррекций по предыдущим
+  if (use_jcbb) {
+    associate_jcbb();
+  }
+  if (batch_update) {
+    // все измерения ассоциируются по прогнозу, затем одна коррекция,
+    // новые маяки добавляются уже от скорректированного положения робота
+    batch_associations.clear();
+    batch_new_measurements.clear();
+    for (std::size_t i = 0; i < new_landmarks.size(); ++i) {
+      const auto landmark_index = use_jcbb ? associations[i] : associate_measurement(i);
+      if (landmark_index >= 0) {
+        batch_associations.emplace_back(landmark_index, i);
+      } else if (landmark_index == NEW_LANDMARK) {
+        batch_new_measurements.push_back(i);
+      }
+    }
+    correct_batch();
+    for (std::size_t i : batch_new_measurements) {
+      add_landmark_to_state(i);
+    }
+  } else {
+    for (std::size_t i = 0; i < new_landmarks.size(); ++i) {
+      const auto landmark_index = use_jcbb ? associations[i] : associate_measurement(i);
+      if (landmark_index >= 0) {
+        correct(landmark_index, i);
+      } else if (landmark_index == NEW_LANDMARK) {
+        add_landmark_to_state(i);
+      }
     }
   }
   publish_results("map", scan.header.stamp);
@@ -281,7 +632,8 @@ void fill_pose_msg(geometry_msgs::Pose& pose,
 }
 
 
-void Slam::publish_results(const std::string& frame, const ros::Time& time) {
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::publish_results(const std::string& frame, const ros::Time& time) {
   geometry_msgs::PoseStamped pose;
   pose.header.frame_id = frame;
   pose.header.stamp = time;
@@ -290,17 +642,28 @@ void Slam::publish_results(const std::string& frame, const ros::Time& time) {
   pose_pub.publish(pose);
 
   // публикуем сообщения с положениями маяков
-  for (int i = 0; i < landmarks_found_quantity; ++i)
-  {
+  auto publish_landmark = [&](std::size_t i) {
     geometry_msgs::PoseStamped pose;
     pose.header.frame_id = frame;
     pose.header.stamp = time;
     fill_pose_msg(pose.pose, X(ROBOT_STATE_SIZE + i * 2), X(ROBOT_STATE_SIZE + i * 2 + 1), 0);
     landmark_pub[i].publish(pose);
+  };
+  // в режимах графа и FastSLAM - только уточненные последним обновлением, чтобы публикация не росла с картой
+  if (use_graph || use_fastslam) {
+    for (std::size_t i : use_graph ? graph.updated_landmarks() : fastslam->observed_landmarks()) {
+      publish_landmark(i);
+    }
+    return;
+  }
+  for (std::size_t i = 0; i < landmarks_found_quantity; ++i)
+  {
+    publish_landmark(i);
   }
 }
 
-void Slam::publish_transform(const std_msgs::Header& scan_header)
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::publish_transform(const std_msgs::Header& scan_header)
 {  
   // публикуем трансформ от скана до карты, 
   // не наоборот, так как дерево tf - однонаправленное
@@ -331,59 +694,67 @@ void Slam::publish_transform(const std_msgs::Header& scan_header)
                                         map_frame));
 }
 
-void Slam::predict(double dt)
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::predict(const Eigen::Vector3d& motion)
 {
-
-  X(0) += v * cos(X(2)) * dt;
-  X(1) += v * sin(X(2)) * dt;
-  X(2) += w * dt;
+  // перемещение в СК карты
+  const double dx = motion(0) * cos(X(2)) - motion(1) * sin(X(2));
+  const double dy = motion(0) * sin(X(2)) + motion(1) * cos(X(2));
+  X(0) += dx;
+  X(1) += dy;
+  X(2) += motion(2);
   X(2) = angles::normalize_angle(X(2));
 
   // вычисляем якобиан
   A = Eigen::Matrix3d::Identity();
-  A(0,0) = 1.0; A(0,1) = 0; A(0,2) = -v * sin(X(2)) * dt;
-  A(1,0) = 0.0; A(1,1) = 1.0; A(1,2) = v * cos(X(2)) * dt;
+  A(0,0) = 1.0; A(0,1) = 0; A(0,2) = -dy;
+  A(1,0) = 0.0; A(1,1) = 1.0; A(1,2) = dx;
   A(2,0) = 0.0; A(2,1) = 0.0; A(2,2) = 1.0;
 
+  if (square_root) {
+    square_root_ekf::predict(P_sqrt, state_size(), A, R_sqrt);
+    return;
+  }
+
   // P = A*P*AT + R для блока соответствующего роботу
   P.topLeftCorner(ROBOT_STATE_SIZE, ROBOT_STATE_SIZE) =
       A * P.topLeftCorner(ROBOT_STATE_SIZE, ROBOT_STATE_SIZE) * A.transpose() + R;
-  // для остальных блоков
-  P.topRightCorner(ROBOT_STATE_SIZE, NUMBER_LANDMARKS * 2) = 
-    A * P.topRightCorner(ROBOT_STATE_SIZE, NUMBER_LANDMARKS * 2);
-  P.bottomLeftCorner(NUMBER_LANDMARKS * 2, ROBOT_STATE_SIZE) = 
-    P.topRightCorner(ROBOT_STATE_SIZE, NUMBER_LANDMARKS * 2).transpose();
+  // в режиме графа это ковариация перемещения от последнего ключевого кадра, маяков в P нет
+  if (use_graph) {
+    return;
+  }
+  // для блоков связи робота с обнаруженными маяками
+  const std::size_t landmarks_size = 2 * landmarks_found_quantity;
+  P.block(0, ROBOT_STATE_SIZE, ROBOT_STATE_SIZE, landmarks_size) =
+    A * P.block(0, ROBOT_STATE_SIZE, ROBOT_STATE_SIZE, landmarks_size);
+  P.block(ROBOT_STATE_SIZE, 0, landmarks_size, ROBOT_STATE_SIZE) =
+    P.block(0, ROBOT_STATE_SIZE, ROBOT_STATE_SIZE, landmarks_size).transpose();
 }
 
-void Slam::advertize_landmark_publishers()
+template <int MaxLandmarks>
+void Slam<MaxLandmarks>::advertize_landmark_publishers()
 {
   std::string landmark("landmark");
-  for (int i = 0; i < NUMBER_LANDMARKS; ++i)
+  for (std::size_t i = landmark_pub.size(); i < landmarks_found_quantity; ++i)
   {
     std::stringstream stream;
     // landmark0 landmark1 ...
     stream << landmark << i;
-    landmark_pub[i] = nh.advertise<geometry_msgs::PoseStamped>(stream.str(), 1);
+    landmark_pub.push_back(nh.advertise<geometry_msgs::PoseStamped>(stream.str(), 1));
   }
 }
 
-Slam::Slam():
+template <int MaxLandmarks>
+Slam<MaxLandmarks>::Slam():
     nh("~"),
-    odo_sub(nh.subscribe("/odom", 1, &Slam::on_odo, this)),
-    scan_sub(nh.subscribe("/scan", 1, &Slam::on_scan, this)),
+    scan_sub(nh.subscribe("/scan", 1, &Slam<MaxLandmarks>::on_scan, this)),
     pose_pub(nh.advertise<geometry_msgs::PoseStamped>("slam_pose", 1)),
-    X(ROBOT_STATE_SIZE + 2*NUMBER_LANDMARKS),
+    X(StateVector::Zero(ROBOT_STATE_SIZE +
+                        2 * (MaxLandmarks == Eigen::Dynamic ? INITIAL_LANDMARK_CAPACITY : MaxLandmarks))),
     A(Eigen::Matrix3d::Identity()),
-    P(Eigen::MatrixXd::Zero(X.size(), X.size()))
+    P(Covariance::Zero(X.size(), X.size())),
+    P_sqrt(Covariance::Zero(X.size(), X.size()))
 {
-  // начальный вектор состояния заполняем нулями
-  X = Eigen::VectorXd::Zero(X.size());
-  // записываем огромное значение начальной ковариации для маяков
-  P.bottomRightCorner(NUMBER_LANDMARKS * 2, NUMBER_LANDMARKS * 2) =
-      HUGE_COVARIANCE * Eigen::MatrixXd::Identity(NUMBER_LANDMARKS * 2, NUMBER_LANDMARKS * 2);
-
-  advertize_landmark_publishers();
-
   Q = Eigen::Matrix2d::Zero();
   Q(0, 0) = nh.param<double>("range_sigma_sqr", 0.01);
   Q(1, 1) = nh.param<double>("angle_sigma_sqr", 0.001);
@@ -391,6 +762,36 @@ Slam::Slam():
   R(0, 0) = nh.param<double>("x_sigma_sqr", 0.001);
   R(1, 1) = nh.param<double>("y_sigma_sqr", 0.001);
   R(2, 2) = nh.param<double>("angle_sigma_sqr", 0.0001);
+  Q_sqrt = Q.llt().matrixL();
+  R_sqrt = R.llt().matrixL();
+  // буферы скана выделяются сразу по емкости состояния, при большем числе измерений они растут
+  const std::size_t landmark_capacity = (X.size() - ROBOT_STATE_SIZE) / 2;
+  grid_positions.reserve(landmark_capacity);
+  new_landmarks.reserve(landmark_capacity);
+  new_landmarks_measurement.reserve(landmark_capacity);
+  batch_associations.reserve(landmark_capacity);
+  batch_new_measurements.reserve(landmark_capacity);
+  jcbb_nearest_distance.reserve(landmark_capacity);
+  associations.reserve(landmark_capacity);
+  jcbb_candidates.resize(landmark_capacity);
+  jcbb.reserve(landmark_capacity, landmark_capacity);
+  if ((use_graph || use_fastslam) && use_jcbb) {
+    ROS_WARN_STREAM("graph and fastslam backends associate measurements independently, association: jcbb is ignored");
+  }
+  if (use_fastslam) {
+    fastslam.reset(new FastSlam(nh.param<int>("fastslam_particles", 100), nh.param<int>("fastslam_threads", 0),
+                                R, Q, association_gate, new_landmark_gate));
+  }
+
+  // одометрия принимается в своем потоке, очередь подписки вмещает сообщения за время обработки скана
+  odometry_nh.setCallbackQueue(&odometry_queue);
+  odo_sub = odometry_nh.subscribe("/odom", 100, &Slam<MaxLandmarks>::on_odo, this);
+  odometry_spinner.start();
 
   std::cout.precision(4);
 }
+
+template class Slam<16>;
+template class Slam<32>;
+template class Slam<48>;
+template class Slam<Eigen::Dynamic>;
@@ -1,4 +1,5 @@
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <sensor_msgs/LaserScan.h>
 #include <nav_msgs/Odometry.h>
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
@@ -6,26 +7,76 @@
 #include <Eigen/Eigen>
 #include <Eigen/Core>
 #include <tf/transform_broadcaster.h>
+#include <simple_map/beam_directions.h>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "circle_fit.h"
+#include "fastslam.h"
+#include "joint_compatibility.h"
+#include "landmark_grid.h"
+#include "odometry_buffer.h"
+#include "pose_graph.h"
+#include "square_root_ekf.h"
 
 // Размер состояния робота
 const std::size_t ROBOT_STATE_SIZE = 3;
-// Количество маяков
-const std::size_t NUMBER_LANDMARKS = 12;
-// Очень большая ковариация для маяков
-const double HUGE_COVARIANCE = 1e10;
+// Начальный запас места в состоянии под маяки для Slam<Eigen::Dynamic>,
+// дальше он удваивается по мере обнаружения маяков
+const std::size_t INITIAL_LANDMARK_CAPACITY = 16;
+// Результаты ассоциации измерения, когда оно не сопоставлено с маяком
+// измерение далеко от всех маяков - это новый маяк
+const int NEW_LANDMARK = -1;
+// измерение не прошло строгий порог, но слишком близко к маяку, чтобы считать его новым - отбрасываем
+const int AMBIGUOUS_MEASUREMENT = -2;
 
+/**
+ * @brief EKF SLAM по круглым маякам
+ *
+ * MaxLandmarks - наибольшее число маяков. Матрицы фильтра имеют переменный размер,
+ * но хранятся внутри объекта в массивах на MaxLandmarks маяков (max-size матрицы Eigen),
+ * поэтому прогноз и коррекция не выделяют память в куче. При MaxLandmarks = Eigen::Dynamic
+ * память выделяется в куче и запас удваивается по мере обнаружения маяков.
+ * Явно инстанцированы емкости 16, 32, 48 и Eigen::Dynamic, выбор - параметром max_landmarks.
+ * Больше 48 маяков фиксированная емкость не допускает: Eigen ограничивает размер
+ * матрицы без кучи 128 КБ (EIGEN_STACK_ALLOCATION_LIMIT), а P для 48 маяков - 99x99.
+ */
+template <int MaxLandmarks>
 class Slam {
+public:
+  // Наибольший размер состояния и наибольший размер пакета измерений (по 2 на маяк)
+  static const int MaxStateSize =
+      MaxLandmarks == Eigen::Dynamic ? Eigen::Dynamic : static_cast<int>(ROBOT_STATE_SIZE) + 2 * MaxLandmarks;
+  static const int MaxBatchSize = MaxLandmarks == Eigen::Dynamic ? Eigen::Dynamic : 2 * MaxLandmarks;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 1, 0, MaxStateSize, 1> StateVector;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, MaxStateSize, MaxStateSize> Covariance;
+  // P * Gi^T и коэффициент усиления для одного измерения
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 2, 0, MaxStateSize, 2> Gain;
+
 private:
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, MaxStateSize, MaxBatchSize> BatchGain;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, MaxBatchSize, MaxBatchSize> BatchCovariance;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, MaxBatchSize, MaxStateSize> BatchGainT;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 1, 0, MaxBatchSize, 1> BatchVector;
+  // Наибольшее число измерений в одной пакетной коррекции, остальные применяются последовательно
+  static const std::size_t max_batch_measurements =
+      MaxLandmarks == Eigen::Dynamic ? std::numeric_limits<std::size_t>::max() : MaxLandmarks;
+
   // Узел ROS
   ros::NodeHandle nh;
+  // Очередь и узел одометрии: сообщения одометрии обрабатываются в отдельном потоке,
+  // не дожидаясь обработки скана
+  ros::CallbackQueue odometry_queue;
+  ros::NodeHandle odometry_nh;
   // Подписчик на данные одометрии
   ros::Subscriber odo_sub;
   // Подписчик на данные лидара
   ros::Subscriber scan_sub;
   // Публикатор положения робота
   ros::Publisher pose_pub;
-  // Публикатор положений маяков
-  ros::Publisher landmark_pub[NUMBER_LANDMARKS];
+  // Публикаторы положений маяков, по одному на обнаруженный маяк
+  std::vector<ros::Publisher> landmark_pub;
   
   // Обработчики событий
   void on_odo(const nav_msgs::Odometry& odom);
@@ -33,38 +84,75 @@ private:
   
   // Публикация результатов
   void publish_results(const std::string& frame, const ros::Time& time);
-  // Прогнозирование состояния
-  void predict(double dt);
-  // Инициализация публикаторов для маяков
+  // Прогнозирование состояния по перемещению робота motion в его СК на время прошлого скана
+  void predict(const Eigen::Vector3d& motion);
+  // Перемещение робота по одометрии с прошлого скана до времени stamp
+  Eigen::Vector3d odometry_motion(const ros::Time& stamp);
+  // Инициализация публикаторов для вновь обнаруженных маяков
   void advertize_landmark_publishers();
+  // Размер активной части состояния: робот и обнаруженные маяки
+  std::size_t state_size() const { return ROBOT_STATE_SIZE + 2 * landmarks_found_quantity; }
+  // Увеличение места в X и P под заданное количество маяков, false - если место исчерпано
+  bool reserve_landmarks(std::size_t count);
   
   // Детекция маяков по данным лидара
   void detect_landmarks(const sensor_msgs::LaserScan& scan);
-  // Добавление информации о маяке
-  void add_landmark(const sensor_msgs::LaserScan& scan, std::size_t start, std::size_t finish);
-  // Ассоциация измерения с маяком
-  int associate_measurement(const Eigen::Vector2d& landmark_measurement);
+  // Добавление маяка по точкам скана scan_x, scan_y с индексами [start, finish)
+  void add_landmark(std::size_t start, std::size_t finish);
+  // Ассоциация измерения с маяком по расстоянию Махаланобиса
+  int associate_measurement(int measurementIndex);
+  // Совместная ассоциация всех измерений скана (JCBB), результат в associations
+  void associate_jcbb();
+  // Индивидуально совместимые с измерением маяки из сетки поиска, отсортированные по расстоянию.
+  // Возвращает минимальный квадрат расстояния Махаланобиса по всем кандидатам
+  double compatible_landmarks(int measurementIndex, AssociationPairs& pairs);
+  // Решение по измерению без пары: новый маяк или неоднозначное измерение
+  int unassociated_measurement(double nearest_distance) const;
+  // Перенос в сетке поиска маяков, чьи текущие оценки попали в другую ячейку
+  void update_landmark_grid();
+  // Прогноз измерения маяка и якобианы по состоянию робота и маяка
+  void observation_model(int landmarkIndex, Eigen::Vector2d& measurementPred,
+                         Eigen::Matrix<double, 2, 3>& Gi_x, Eigen::Matrix2d& Gi_m) const;
+  // Ковариация невязки Gi * P * Gi^T + Q, собранная из блоков P робота и маяка
+  Eigen::Matrix2d innovation_covariance(int landmarkIndex, const Eigen::Matrix<double, 2, 3>& Gi_x,
+                                        const Eigen::Matrix2d& Gi_m) const;
   // Добавление информации о маяке в состояние
   int add_landmark_to_state(int measurementIndex);
   // Коррекция состояния по измерению маяка
   void correct(int landmarkIndex, int measurementIndex);
+  // Одна коррекция состояния по всем ассоциированным измерениям скана из batch_associations
+  void correct_batch();
+  // Ковариация положения робота
+  Eigen::Matrix3d robot_covariance() const;
+  // Обработка скана графовым бэкендом: ключевой кадр, факторы и инкрементальное решение
+  void update_graph();
+  // Обработка скана в режиме FastSLAM по перемещению робота motion с прошлого скана
+  void update_fastslam(const Eigen::Vector3d& motion);
   // Публикация трансформации
   void publish_transform(const std_msgs::Header& scan_header);
 
-  // Линейная и угловая скорости
-  double v = 0;
-  double w = 0;
+  // Буфер одометрии для прогноза точно до времени скана, заполняется из потока одометрии
+  OdometryBuffer odometry{static_cast<std::size_t>(nh.param<int>("odometry_buffer_size", 500))};
+  std::mutex odometry_mutex;
+  // Поток обработки очереди одометрии
+  ros::AsyncSpinner odometry_spinner{1, &odometry_queue};
 
-  // Вектор состояния
-  Eigen::VectorXd X;
+  // Вектор состояния. Память выделяется с запасом, используется только
+  // начальная часть размером state_size(), остальное - место под новые маяки
+  StateVector X;
   // Линеаризованная матрица системы
   Eigen::Matrix3d A;
-  // Матрица ковариации ошибок оценок
-  Eigen::MatrixXd P;
+  // Матрица ковариации ошибок оценок, используется левый верхний блок state_size() x state_size()
+  Covariance P;
+  // Нижнетреугольный множитель P = P_sqrt * P_sqrt^T, в режиме square_root хранится он, а не P
+  Covariance P_sqrt;
   // Матрица ковариации ошибок измерения
   Eigen::Matrix2d Q;
   // Матрица ковариации возмущений системы
   Eigen::Matrix3d R;
+  // Множители Холецкого Q и R для режима square_root
+  Eigen::Matrix2d Q_sqrt;
+  Eigen::Matrix3d R_sqrt;
 
   // Время последнего измерения
   ros::Time last_time = ros::Time::now();
@@ -82,9 +170,78 @@ private:
 
   // Имя фрейма карты (параметр ROS)
   const std::string map_frame = nh.param<std::string>("map_frame", "map");
-  // Радиус маяка
+  // Радиус маяка, он же наибольший зазор между соседними точками одного маяка
   double feature_rad = nh.param<double>("feature_radius", 1.0);
+  // Допустимое отклонение радиуса окружности по точкам кластера от feature_rad в долях feature_rad,
+  // кластеры вне допуска (стены, крупные препятствия) маяками не считаются
+  double feature_radius_tolerance = nh.param<double>("feature_radius_tolerance", 1.0);
+  // Таблицы направлений лучей и точки последнего скана в СК дальномера
+  simple_map::BeamDirectionCache beam_directions;
+  std::vector<float> scan_x;
+  std::vector<float> scan_y;
+  // Порог квадрата расстояния Махаланобиса для ассоциации, chi2(2 степени свободы, 0.99)
+  double association_gate = nh.param<double>("association_gate", 9.21);
+  // Порог, выше которого несопоставленное измерение считается новым маяком, chi2(2, 0.999)
+  double new_landmark_gate = nh.param<double>("new_landmark_gate", 13.82);
+  // Радиус поиска кандидатов для ассоциации вокруг измерения в СК карты, м
+  double association_radius = nh.param<double>("association_radius", 5.0);
+  // Сетка поиска маяков, размер ячейки равен радиусу поиска
+  LandmarkGrid landmark_grid{association_radius};
+  // Положения маяков, по которым они разложены в сетке в режиме ekf
+  std::vector<Eigen::Vector2d> grid_positions;
+  // Буфер кандидатов для ассоциации
+  std::vector<int> association_candidates;
+  // Буфер совместимых пар для ассоциации одного измерения
+  AssociationPairs association_pairs;
+  // Способ ассоциации: nearest - независимо для каждого измерения, jcbb - совместно для скана
+  const bool use_jcbb = nh.param<std::string>("association", "nearest") == "jcbb";
+  // Поиск совместной ассоциации, порог - квантиль chi2 для jcbb_confidence
+  JointCompatibility jcbb{nh.param<double>("jcbb_confidence", 0.99),
+                          static_cast<std::size_t>(nh.param<int>("jcbb_max_nodes", 20000))};
+  // Совместимые пары по каждому измерению скана для JCBB
+  std::vector<AssociationPairs> jcbb_candidates;
+  // Минимальные расстояния Махаланобиса измерений скана до кандидатов в режиме JCBB
+  std::vector<double> jcbb_nearest_distance;
+  // Результат ассоциации измерений скана в режиме JCBB
+  std::vector<int> associations;
+  // Фильтр в форме квадратного корня ковариации: вместо P обновляется ее треугольный множитель,
+  // P остается симметричной и положительно определенной на длинных проездах
+  const bool square_root = nh.param<bool>("square_root", false);
+  // Коррекция по всем измерениям скана одним шагом фильтра вместо последовательных коррекций
+  const bool batch_update = nh.param<bool>("batch_update", false);
+  // Пары (маяк, измерение) скана для пакетной коррекции
+  std::vector<std::pair<int, int>> batch_associations;
+  // Измерения новых маяков, которые добавляются после пакетной коррекции
+  std::vector<std::size_t> batch_new_measurements;
+  // Буферы пакетной коррекции
+  Eigen::Matrix<double, Eigen::Dynamic, 3, 0, MaxBatchSize, 3> batch_Gx;
+  Eigen::Matrix<double, Eigen::Dynamic, 2, 0, MaxBatchSize, 2> batch_Gm;
+  BatchGain batch_PHt;
+  BatchCovariance batch_S;
+  Eigen::LLT<BatchCovariance> batch_llt;
+  BatchGainT batch_Kt;
+  BatchVector batch_innovation;
+  // Бэкенд: ekf - фильтр, graph - граф положений с инкрементальным решателем
+  // (ассоциация всегда nearest, P хранит только ковариацию перемещения от последнего ключевого кадра)
+  const bool use_graph = nh.param<std::string>("backend", "ekf") == "graph";
+  // Граф: окно инкрементального шага, период и средняя доля полного прохода, итерации Гаусса-Ньютона
+  PoseGraph graph{static_cast<std::size_t>(nh.param<int>("graph_window", 10)),
+                  static_cast<std::size_t>(nh.param<int>("graph_relinearize_interval", 50)),
+                  static_cast<std::size_t>(nh.param<int>("graph_relinearize_budget", 50)),
+                  static_cast<std::size_t>(nh.param<int>("graph_iterations", 5))};
+  // Перемещение или поворот от последнего ключевого кадра, после которого добавляется новый, м и рад.
+  // Сканы между ключевыми кадрами только продолжают счисление пути
+  double keyframe_distance = nh.param<double>("graph_keyframe_distance", 0.3);
+  double keyframe_angle = nh.param<double>("graph_keyframe_angle", 0.1);
+  // Бэкенд fastslam - фильтр частиц FastSLAM 2.0, создается в конструкторе только в этом режиме.
+  // Частиц fastslam_particles, потоков fastslam_threads (0 - по числу ядер)
+  const bool use_fastslam = nh.param<std::string>("backend", "ekf") == "fastslam";
+  std::unique_ptr<FastSlam> fastslam;
+  // Кандидаты ассоциации для каждого измерения скана в режиме FastSLAM
+  std::vector<std::vector<int>> fastslam_candidates;
 
 public:
   Slam();
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
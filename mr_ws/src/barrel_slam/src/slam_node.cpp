@@ -1,12 +1,44 @@
 #include <ros/ros.h>
+#include <memory>
 #include "slam.h"
 
+template <int MaxLandmarks>
+void run_slam(int max_landmarks)
+{
+  // емкость округляется вверх до ближайшей инстанцированной, сообщаем какая выбрана на самом деле
+  if (MaxLandmarks == Eigen::Dynamic) {
+    ROS_INFO("landmark capacity is unlimited, state memory grows on demand");
+  } else {
+    ROS_INFO("max_landmarks %d: using fixed landmark capacity %d", max_landmarks, MaxLandmarks);
+  }
+  // матрицы фиксированной емкости хранятся внутри объекта, поэтому он создается в куче
+  std::unique_ptr<Slam<MaxLandmarks>> slam(new Slam<MaxLandmarks>);
+  ros::spin();
+}
+
 int main(int argc, char* argv[])
 {
   ros::init(argc, argv, "barrel_slam");
-  Slam slam;
-  ros::spin();
+  // наибольшее число маяков, 0 - без ограничения (память растет по мере обнаружения маяков)
+  const int max_landmarks = ros::NodeHandle("~").param<int>("max_landmarks", 0);
+  // бэкенды graph и fastslam хранят маяки у себя, фиксированная емкость относится только к фильтру
+  const bool use_ekf = ros::NodeHandle("~").param<std::string>("backend", "ekf") == "ekf";
+  if (max_landmarks > 0 && !use_ekf) {
+    ROS_WARN("max_landmarks is used only by the ekf backend and is ignored");
+  } else if (max_landmarks > 48) {
+    ROS_WARN("max_landmarks %d exceeds the largest fixed capacity 48", max_landmarks);
+  }
+  if (max_landmarks <= 0 || !use_ekf) {
+    run_slam<Eigen::Dynamic>(max_landmarks);
+  } else if (max_landmarks <= 16) {
+    run_slam<16>(max_landmarks);
+  } else if (max_landmarks <= 32) {
+    run_slam<32>(max_landmarks);
+  } else if (max_landmarks <= 48) {
+    run_slam<48>(max_landmarks);
+  } else {
+    run_slam<Eigen::Dynamic>(max_landmarks);
+  }
   return 0;
 
 }
-
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+#include <Eigen/Eigenvalues>
+#include <Eigen/QR>
+#include <cmath>
+#include <cstddef>
+
+/**
+ * Шаги EKF SLAM в форме квадратного корня ковариации
+ *
+ * Вместо P хранится нижнетреугольный множитель L, P = L * L^T. Состояние - робот (3)
+ * и маяки (по 2), используется левый верхний блок L размера n x n. Множитель обновляется
+ * только ортогональными преобразованиями (Хаусхолдер, Гивенс) и рангово-единичными
+ * повышениями, поэтому P = L * L^T остается симметричной и неотрицательно определенной
+ * при любых ошибках округления. Стоимость прогноза и коррекции - O(n^2).
+ */
+namespace square_root_ekf {
+
+// Повышение ранга L * L^T + x * x^T для нижнетреугольного блока L, x портится.
+// Вращение Гивенса столбцов (L_k, x) делит только на r = hypot(L(k, k), x(k)) > 0,
+// поэтому нулевой диагональный элемент L не дает NaN
+template <typename Factor, typename Vector>
+void rank_one_update(Factor&& L, Vector&& x)
+{
+  const Eigen::Index n = L.rows();
+  for (Eigen::Index k = 0; k < n; ++k) {
+    if (x(k) == 0) {
+      continue;
+    }
+    const double r = std::hypot(L(k, k), x(k));
+    const double c = L(k, k) / r;
+    const double s = x(k) / r;
+    L(k, k) = r;
+    for (Eigen::Index i = k + 1; i < n; ++i) {
+      const double l = L(i, k);
+      L(i, k) = c * l + s * x(i);
+      x(i) = c * x(i) - s * l;
+    }
+  }
+}
+
+// Нижнетреугольный множитель симметричной матрицы 2x2. Если разложение Холецкого не удалось
+// (матрица вырождена или не положительно определена из-за округления), собственные значения
+// ограничиваются снизу min_variance. Возвращает false, если понадобилась регуляризация
+inline bool factor(const Eigen::Matrix2d& P, double min_variance, Eigen::Matrix2d& L)
+{
+  const Eigen::LLT<Eigen::Matrix2d> llt(P);
+  if (llt.info() == Eigen::Success && llt.matrixLLT()(0, 0) > 0 && llt.matrixLLT()(1, 1) > 0) {
+    L = llt.matrixL();
+    return true;
+  }
+  const Eigen::SelfAdjointEigenSolver<Eigen::Matrix2d> eigen(0.5 * (P + P.transpose()));
+  const Eigen::Vector2d values = eigen.eigenvalues().cwiseMax(min_variance);
+  L = Eigen::LLT<Eigen::Matrix2d>(eigen.eigenvectors() * values.asDiagonal()
+                                  * eigen.eigenvectors().transpose()).matrixL();
+  return false;
+}
+
+// Прогноз P = A * P * A^T + R, где A меняет только состояние робота, R_sqrt - множитель R.
+// Строки робота [A * L00, R_sqrt] приводятся к треугольному виду QR-разложением,
+// то же ортогональное преобразование применяется к строкам маяков, а его остаток E
+// добавляется к блоку маяков повышением ранга 3
+template <typename Factor>
+void predict(Factor& L, std::size_t n, const Eigen::Matrix3d& A, const Eigen::Matrix3d& R_sqrt)
+{
+  Eigen::Matrix<double, 6, 3> robot_rows_t;
+  robot_rows_t.topRows<3>() = (A * L.template topLeftCorner<3, 3>().template triangularView<Eigen::Lower>()).transpose();
+  robot_rows_t.bottomRows<3>() = R_sqrt.transpose();
+  const Eigen::HouseholderQR<Eigen::Matrix<double, 6, 3>> qr(robot_rows_t);
+  Eigen::Matrix<double, 6, 6> theta = qr.householderQ();
+  Eigen::Matrix3d R_upper = qr.matrixQR().topRows<3>().triangularView<Eigen::Upper>();
+  // знаки выбираются так, чтобы диагональ множителя была положительной
+  for (int i = 0; i < 3; ++i) {
+    if (R_upper(i, i) < 0) {
+      R_upper.row(i) = -R_upper.row(i);
+      theta.col(i) = -theta.col(i);
+    }
+  }
+  L.template topLeftCorner<3, 3>() = R_upper.transpose();
+
+  const std::size_t k = n - 3;
+  if (k == 0) {
+    return;
+  }
+  // строки маяков [L_l0, 0] * theta: первые 3 столбца - новый L_l0, остальные - E
+  Eigen::Matrix<double, Eigen::Dynamic, 3, 0, Factor::MaxRowsAtCompileTime, 3> E =
+      L.block(3, 0, k, 3) * theta.template topRightCorner<3, 3>();
+  L.block(3, 0, k, 3) = L.block(3, 0, k, 3) * theta.template topLeftCorner<3, 3>();
+  for (int i = 0; i < 3; ++i) {
+    rank_one_update(L.block(3, 3, k, k), E.col(i));
+  }
+}
+
+// Коррекция по измерению маяка с якобианами Gi_x (по роботу) и Gi_m (по маяку со смещением mi),
+// Q_sqrt - нижнетреугольный множитель ковариации измерения.
+// Предмассив [[Q_sqrt, Gi * L], [0, L]] вращениями Гивенса по столбцам приводится
+// к [[S_sqrt, 0], [K_bar, L+]], где S = S_sqrt * S_sqrt^T - ковариация невязки,
+// K = K_bar * S_sqrt^-1 - коэффициент усиления, L+ - множитель апостериорной ковариации
+template <typename Factor, typename State>
+void correct(Factor& L, State& X, std::size_t n, const Eigen::Matrix<double, 2, 3>& Gi_x,
+             const Eigen::Matrix2d& Gi_m, std::size_t mi, const Eigen::Matrix2d& Q_sqrt,
+             const Eigen::Vector2d& innovation)
+{
+  // Gi * L: ненулевые столбцы - до mi + 1 включительно
+  const std::size_t cols = mi + 2;
+  Eigen::Matrix<double, 2, Eigen::Dynamic, 0, 2, Factor::MaxColsAtCompileTime> GL =
+      Gi_m * L.block(mi, 0, 2, cols);
+  GL.template leftCols<3>() += Gi_x * L.template topLeftCorner<3, 3>();
+
+  Eigen::Matrix2d S_sqrt = Q_sqrt;
+  Eigen::Matrix<double, Eigen::Dynamic, 2, 0, Factor::MaxRowsAtCompileTime, 2> K_bar =
+      Eigen::Matrix<double, Eigen::Dynamic, 2, 0, Factor::MaxRowsAtCompileTime, 2>::Zero(n, 2);
+
+  for (int r = 0; r < 2; ++r) {
+    // столбцы обходятся справа налево: тогда заполнение K_bar приходится на строки ниже
+    // текущего столбца и L остается нижнетреугольным
+    for (std::size_t j = cols; j-- > 0;) {
+      const double b = GL(r, j);
+      if (b == 0) {
+        continue;
+      }
+      const double a = S_sqrt(r, r);
+      const double h = std::hypot(a, b);
+      const double c = a / h;
+      const double s = b / h;
+      // поворот пары столбцов (r предмассива, j предмассива)
+      S_sqrt(r, r) = h;
+      GL(r, j) = 0;
+      if (r == 0) {
+        const double u = S_sqrt(1, 0);
+        const double v = GL(1, j);
+        S_sqrt(1, 0) = c * u + s * v;
+        GL(1, j) = -s * u + c * v;
+      }
+      const std::size_t tail = n - j;
+      auto k_col = K_bar.col(r).tail(tail);
+      auto l_col = L.col(j).segment(j, tail);
+      const Eigen::Matrix<double, Eigen::Dynamic, 1, 0, Factor::MaxRowsAtCompileTime, 1> u = k_col;
+      k_col = c * u + s * l_col;
+      l_col = -s * u + c * l_col;
+    }
+  }
+
+  X.head(n).noalias() += K_bar * S_sqrt.triangularView<Eigen::Lower>().solve(innovation);
+}
+
+// Ковариация невязки Gi * L * L^T * Gi^T + Q по множителю, O(mi)
+template <typename Factor>
+Eigen::Matrix2d innovation_covariance(const Factor& L, const Eigen::Matrix<double, 2, 3>& Gi_x,
+                                      const Eigen::Matrix2d& Gi_m, std::size_t mi, const Eigen::Matrix2d& Q)
+{
+  Eigen::Matrix<double, 2, Eigen::Dynamic, 0, 2, Factor::MaxColsAtCompileTime> GL =
+      Gi_m * L.block(mi, 0, 2, mi + 2);
+  GL.template leftCols<3>() += Gi_x * L.template topLeftCorner<3, 3>();
+  return GL * GL.transpose() + Q;
+}
+
+}
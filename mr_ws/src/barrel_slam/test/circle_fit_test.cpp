@@ -0,0 +1,111 @@
+/*
+ * circle_fit_test.cpp
+ *
+ * Тест аппроксимации окружности по точкам скана маяка. Дальномер видит ближнюю сторону
+ * маяка лучами через 0.5 градуса с шумом дальности, центр по методу Таубина сравнивается
+ * с истинным и с прежней оценкой (средняя дальность плюс радиус по среднему пеленгу).
+ * Точки на прямой (стена) окружности не дают.
+ */
+
+#include "../src/circle_fit.h"
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace {
+
+const double kRadius = 1.0;
+const double kAngleIncrement = M_PI / 360;
+const double kRangeSigma = 0.02;
+
+struct Errors
+{
+  double fit;
+  double average;
+  double radius;
+  int failures;
+};
+
+// Средние ошибки центра для маяка на расстоянии distance по trials случайным пеленгам
+Errors run(double distance, int trials, std::mt19937& rng)
+{
+  std::normal_distribution<double> noise(0.0, kRangeSigma);
+  std::uniform_real_distribution<double> uniform(-M_PI / 3, M_PI / 3);
+  Errors errors{0, 0, 0, 0};
+  std::vector<float> x, y;
+  for (int trial = 0; trial < trials; ++trial) {
+    const double bearing = uniform(rng);
+    const Eigen::Vector2d center = distance * Eigen::Vector2d(std::cos(bearing), std::sin(bearing));
+    // лучи, пересекающие окружность: пересечение луча (cos a, sin a) * r с окружностью
+    x.clear();
+    y.clear();
+    double range_sum = 0, angle_sum = 0;
+    const double half_width = std::asin(kRadius / distance);
+    for (double angle = std::ceil((bearing - half_width) / kAngleIncrement) * kAngleIncrement;
+         angle < bearing + half_width; angle += kAngleIncrement) {
+      const Eigen::Vector2d direction(std::cos(angle), std::sin(angle));
+      const double along = direction.dot(center);
+      const double discriminant = along * along - center.squaredNorm() + kRadius * kRadius;
+      if (discriminant < 0) {
+        continue;
+      }
+      const double range = along - std::sqrt(discriminant) + noise(rng);
+      x.push_back(range * direction.x());
+      y.push_back(range * direction.y());
+      range_sum += range;
+      angle_sum += angle;
+    }
+    const double count = x.size();
+    const double average_range = range_sum / count + kRadius;
+    const Eigen::Vector2d average = average_range * Eigen::Vector2d(std::cos(angle_sum / count),
+                                                                    std::sin(angle_sum / count));
+    errors.average += (average - center).norm();
+
+    circle_fit::Circle circle;
+    if (!circle_fit::fit(x.data(), y.data(), x.size(), circle)) {
+      ++errors.failures;
+      continue;
+    }
+    errors.fit += (circle.center - center).norm();
+    errors.radius += std::abs(circle.radius - kRadius);
+  }
+  errors.fit /= trials;
+  errors.average /= trials;
+  errors.radius /= trials;
+  return errors;
+}
+
+bool check_line()
+{
+  std::vector<float> x, y;
+  for (int i = 0; i < 20; ++i) {
+    x.push_back(5.0f);
+    y.push_back(-1.0f + 0.1f * i);
+  }
+  circle_fit::Circle circle;
+  return !circle_fit::fit(x.data(), y.data(), x.size(), circle) || circle.radius > 100;
+}
+
+}
+
+int main()
+{
+  bool ok = true;
+  std::mt19937 rng(5);
+  for (double distance : {3.0, 6.0, 10.0, 15.0}) {
+    const Errors errors = run(distance, 1000, rng);
+    std::cout << "distance " << distance << ": center error " << errors.fit
+              << " (average of beams " << errors.average << "), radius error " << errors.radius
+              << ", failures " << errors.failures << std::endl;
+    if (errors.failures > 0 || errors.fit > 0.05 || errors.fit > errors.average) {
+      std::cout << "FAIL: circle fit is inaccurate at distance " << distance << std::endl;
+      ok = false;
+    }
+  }
+  if (!check_line()) {
+    std::cout << "FAIL: points on a line fitted as a barrel" << std::endl;
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
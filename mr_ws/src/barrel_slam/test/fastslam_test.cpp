@@ -0,0 +1,156 @@
+/*
+ * fastslam_test.cpp
+ *
+ * Тест режима FastSLAM 2.0. Проверяется, что копия карты частицы не меняется при изменении
+ * оригинала, что на синтетическом проезде по кругу среди маяков оценки робота и маяков
+ * не расходятся с истинными, каждый маяк добавлен в карту один раз, и что результат
+ * не зависит от числа потоков.
+ */
+
+#include "../src/fastslam.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace {
+
+const double kDt = 0.1;
+const double kRange = 10.0;
+const double kCandidateRadius = 5.0;
+
+double normalize_angle(double a)
+{
+  return std::atan2(std::sin(a), std::cos(a));
+}
+
+bool check_persistence()
+{
+  LandmarkMap map;
+  LandmarkEstimate estimate;
+  estimate.covariance.setIdentity();
+  for (int i = 0; i < 1000; ++i) {
+    estimate.mean << i, -i;
+    map.push_back(estimate);
+  }
+  const LandmarkMap copy = map;
+  estimate.mean << -1, -1;
+  map.set(500, estimate);
+  map.push_back(estimate);
+  bool ok = copy.size() == 1000 && map.size() == 1001;
+  for (int i = 0; i < 1000; ++i) {
+    ok = ok && copy.get(i).mean == Eigen::Vector2d(i, -i);
+  }
+  return ok && map.get(500).mean == Eigen::Vector2d(-1, -1) && map.get(1000).mean == Eigen::Vector2d(-1, -1);
+}
+
+struct Result
+{
+  double max_error;
+  double landmark_error;
+  std::size_t landmarks;
+  Eigen::Vector3d pose;
+  double seconds;
+};
+
+Result run(std::size_t particles, std::size_t threads, int steps, const std::vector<Eigen::Vector2d>& landmarks)
+{
+  const Eigen::Matrix3d R = Eigen::Vector3d(1e-3, 1e-3, 1e-4).asDiagonal();
+  const Eigen::Matrix2d Q = Eigen::Vector2d(1e-2, 1e-3).asDiagonal();
+  // порог нового маяка - chi2 0.99999: при пороге 0.999 среди десятков тысяч измерений проезда
+  // хвосты шума измерений сами по себе дают десяток ложных маяков
+  FastSlam slam(particles, threads, R, Q, 9.21, 23.03);
+  std::mt19937 rng(11);
+  std::normal_distribution<double> noise(0.0, 1.0);
+
+  Eigen::Vector3d truth = Eigen::Vector3d::Zero();
+  const double v = 1.0, w = 0.1;
+  Result result{0, 0, 0, Eigen::Vector3d::Zero(), 0};
+  std::vector<Eigen::Vector2d> measurements;
+  std::vector<std::vector<int>> candidates;
+  const auto start = std::chrono::steady_clock::now();
+  for (int step = 0; step < steps; ++step) {
+    truth(0) += v * std::cos(truth(2)) * kDt + 0.02 * noise(rng);
+    truth(1) += v * std::sin(truth(2)) * kDt + 0.02 * noise(rng);
+    truth(2) = normalize_angle(truth(2) + w * kDt + 0.005 * noise(rng));
+
+    // кандидаты - маяки лучшей частицы около измерения, перебором
+    measurements.clear();
+    candidates.clear();
+    for (const auto& landmark : landmarks) {
+      const Eigen::Vector2d d = landmark - truth.head<2>();
+      if (d.norm() > kRange) {
+        continue;
+      }
+      const Eigen::Vector2d z(d.norm() + 0.1 * noise(rng),
+                              normalize_angle(std::atan2(d.y(), d.x()) - truth(2) + 0.03 * noise(rng)));
+      measurements.push_back(z);
+      const double bearing = slam.pose()(2) + z(1);
+      const Eigen::Vector2d in_map = slam.pose().head<2>() + z(0) * Eigen::Vector2d(std::cos(bearing), std::sin(bearing));
+      candidates.emplace_back();
+      for (std::size_t i = 0; i < slam.landmark_count(); ++i) {
+        if ((slam.landmark(i) - in_map).norm() < kCandidateRadius) {
+          candidates.back().push_back(i);
+        }
+      }
+    }
+    slam.update(Eigen::Vector3d(v * kDt, 0, w * kDt), measurements, candidates);
+    result.max_error = std::max(result.max_error, (slam.pose().head<2>() - truth.head<2>()).norm());
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result.landmarks = slam.landmark_count();
+  // каждый маяк карты должен быть рядом с одним из истинных
+  for (std::size_t i = 0; i < slam.landmark_count(); ++i) {
+    double nearest = std::numeric_limits<double>::infinity();
+    for (const auto& landmark : landmarks) {
+      nearest = std::min(nearest, (slam.landmark(i) - landmark).norm());
+    }
+    result.landmark_error = std::max(result.landmark_error, nearest);
+  }
+  result.pose = slam.pose();
+  return result;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  const int steps = argc > 1 ? std::atoi(argv[1]) : 3000;
+  bool ok = true;
+  if (!check_persistence()) {
+    std::cout << "FAIL: landmark map copy changed with the original" << std::endl;
+    ok = false;
+  }
+
+  // маяки на двух кольцах вокруг окружности, по которой ездит робот
+  std::vector<Eigen::Vector2d> landmarks;
+  for (int i = 0; i < 24; ++i) {
+    const double a = 2 * M_PI * i / 24;
+    const double r = (i % 2) ? 5.0 : 15.0;
+    landmarks.push_back(Eigen::Vector2d(r * std::cos(a), 10.0 + r * std::sin(a)));
+  }
+
+  const Result single = run(50, 1, steps, landmarks);
+  const Result parallel = run(50, 4, steps, landmarks);
+  std::cout << "steps = " << steps << ", landmarks = " << single.landmarks << " of " << landmarks.size() << std::endl;
+  std::cout << "max robot position error = " << single.max_error
+            << ", max landmark error = " << single.landmark_error << std::endl;
+  std::cout << "1 thread: " << single.seconds << " s, 4 threads: " << parallel.seconds << " s" << std::endl;
+
+  if (!(single.max_error < 1.0 && single.landmark_error < 0.5)) {
+    std::cout << "FAIL: estimate is inconsistent with the ground truth" << std::endl;
+    ok = false;
+  }
+  if (single.landmarks != landmarks.size()) {
+    std::cout << "FAIL: landmark count differs from the true count" << std::endl;
+    ok = false;
+  }
+  if (single.pose != parallel.pose || single.landmarks != parallel.landmarks) {
+    std::cout << "FAIL: result depends on the number of threads" << std::endl;
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
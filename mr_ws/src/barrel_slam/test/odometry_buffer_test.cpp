@@ -0,0 +1,126 @@
+/*
+ * odometry_buffer_test.cpp
+ *
+ * Тест буфера одометрии. Проверяется, что перемещение между моментами сканов, не совпадающими
+ * с моментами сообщений, совпадает с точным движением по дугам при постоянных и меняющихся
+ * скоростях, что переполненный буфер хранит последние сообщения, а сообщения не по порядку
+ * отбрасываются. Для сравнения выводится ошибка прежнего прогноза одним шагом Эйлера
+ * по последним скоростям.
+ */
+
+#include "../src/odometry_buffer.h"
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+
+const double kOdometryPeriod = 0.02;
+const double kScanPeriod = 0.1;
+
+double normalize_angle(double a)
+{
+  return std::atan2(std::sin(a), std::cos(a));
+}
+
+// Скорости одометрии в момент t: разгон и смена направления поворота
+double velocity(double t) { return 1.0 + 2.0 * std::sin(0.5 * t); }
+double turn_rate(double t) { return std::sin(1.3 * t); }
+
+// Перемещение в СК робота на время from, пересчитанное из двух положений в СК одометрии
+Eigen::Vector3d relative(const Eigen::Vector3d& from, const Eigen::Vector3d& to)
+{
+  const double c = std::cos(from(2));
+  const double s = std::sin(from(2));
+  const Eigen::Vector2d d = to.head<2>() - from.head<2>();
+  return Eigen::Vector3d(c * d.x() + s * d.y(), -s * d.x() + c * d.y(), normalize_angle(to(2) - from(2)));
+}
+
+double error(const Eigen::Vector3d& a, const Eigen::Vector3d& b)
+{
+  return std::max((a.head<2>() - b.head<2>()).norm(), std::abs(normalize_angle(a(2) - b(2))));
+}
+
+// Постоянные скорости: перемещение между сканами - точная дуга
+bool check_constant()
+{
+  OdometryBuffer buffer;
+  const double v = 2.0, w = 0.7;
+  for (int i = 0; i < 100; ++i) {
+    buffer.push(i * kOdometryPeriod, v, w);
+  }
+  const double from = 0.513, to = 0.613;
+  const Eigen::Vector3d arc = OdometryBuffer::advance(Eigen::Vector3d::Zero(), v, w, to - from);
+  return error(buffer.motion(from, to), arc) < 1e-9;
+}
+
+// Меняющиеся скорости: эталон - интегрирование кусочно-постоянных скоростей мелким шагом
+bool check_piecewise()
+{
+  OdometryBuffer buffer(1000);
+  double max_error = 0, max_euler_error = 0;
+  // первый скан - после первого сообщения одометрии
+  double last_scan = -1;
+  double next_scan = 0.05;
+  double v = 0, w = 0;
+  int odometry = 0;
+  Eigen::Vector3d truth = Eigen::Vector3d::Zero();
+  Eigen::Vector3d truth_at_scan = truth;
+  const double step = 1e-5;
+  for (int k = 0; k <= 2000000; ++k) {
+    const double t = k * step;
+    // сообщения одометрии сдвинуты относительно сканов
+    if (t >= odometry * kOdometryPeriod + 0.007) {
+      v = velocity(t);
+      w = turn_rate(t);
+      buffer.push(t, v, w);
+      ++odometry;
+    }
+    if (t >= next_scan) {
+      if (last_scan >= 0) {
+        max_error = std::max(max_error, error(buffer.motion(last_scan, t), relative(truth_at_scan, truth)));
+        const Eigen::Vector3d euler(v * (t - last_scan), 0, w * (t - last_scan));
+        max_euler_error = std::max(max_euler_error, error(euler, relative(truth_at_scan, truth)));
+      }
+      last_scan = t;
+      next_scan += kScanPeriod;
+      truth_at_scan = truth;
+    }
+    truth = OdometryBuffer::advance(truth, v, w, step);
+  }
+  std::cout << "piecewise velocities: max error = " << max_error
+            << ", single Euler step error = " << max_euler_error << std::endl;
+  return max_error < 1e-4;
+}
+
+// Переполнение и сообщения не по порядку
+bool check_ring()
+{
+  OdometryBuffer buffer(10);
+  for (int i = 0; i < 100; ++i) {
+    buffer.push(i * kOdometryPeriod, i < 95 ? 1.0 : 3.0, 0.0);
+  }
+  buffer.push(0.5, 100.0, 100.0);
+  const Eigen::Vector3d motion = buffer.motion(93 * kOdometryPeriod, 97 * kOdometryPeriod);
+  return buffer.size() == 10 && error(motion, Eigen::Vector3d(2 * 0.02 + 2 * 0.06, 0, 0)) < 1e-9;
+}
+
+}
+
+int main()
+{
+  bool ok = true;
+  if (!check_constant()) {
+    std::cout << "FAIL: constant velocity motion differs from the arc" << std::endl;
+    ok = false;
+  }
+  if (!check_piecewise()) {
+    std::cout << "FAIL: piecewise velocity motion differs from the reference" << std::endl;
+    ok = false;
+  }
+  if (!check_ring()) {
+    std::cout << "FAIL: ring buffer lost recent messages or accepted an out of order one" << std::endl;
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+/*
+ * pose_graph_test.cpp
+ *
+ * Тест графового бэкенда на синтетическом проезде змейкой по полю из нескольких тысяч маяков,
+ * ассоциация измерений известна. Проверяется, что размер системы каждого шага update()
+ * не растет вместе с картой, а оценки положений робота и маяков близки к истинным
+ * как по одним шагам update(), так и после полного прохода. Отдельно на многократном проезде
+ * по кругу среди одних и тех же маяков проверяется, что число факторов шага не растет
+ * с числом повторных наблюдений маяков.
+ */
+
+#include "../src/pose_graph.h"
+#include <Eigen/Geometry>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace {
+
+const double kSpacing = 4.0;
+const double kRange = 10.0;
+const double kStep = 0.5;
+const double kRowDistance = 12.0;
+
+double normalize_angle(double a)
+{
+  return std::atan2(std::sin(a), std::cos(a));
+}
+
+// Положение b в СК положения a
+Eigen::Vector3d relative(const Eigen::Vector3d& a, const Eigen::Vector3d& b)
+{
+  const Eigen::Vector2d d = Eigen::Rotation2Dd(-a(2)) * (b.head<2>() - a.head<2>());
+  return Eigen::Vector3d(d.x(), d.y(), normalize_angle(b(2) - a(2)));
+}
+
+Eigen::Vector3d compose(const Eigen::Vector3d& a, const Eigen::Vector3d& delta)
+{
+  const Eigen::Vector2d d = Eigen::Rotation2Dd(a(2)) * delta.head<2>();
+  return Eigen::Vector3d(a(0) + d.x(), a(1) + d.y(), normalize_angle(a(2) + delta(2)));
+}
+
+// Круги радиусом 3 м внутри кольца из 12 маяков радиусом 6 м, все маяки видны из каждого положения.
+// Возвращает наибольшее число факторов шага update() и наибольшую ошибку маяка после проезда
+void run_revisits(int laps, std::size_t window, std::size_t& max_factors, double& landmark_error)
+{
+  const std::size_t count = 12;
+  std::mt19937 rng(3);
+  std::normal_distribution<double> noise(0.0, 1.0);
+  const Eigen::Vector3d odometry_sigma(0.01, 0.01, 0.002);
+  const Eigen::Vector2d measurement_sigma(0.05, 0.005);
+  const Eigen::Matrix3d odometry_covariance = odometry_sigma.cwiseAbs2().asDiagonal();
+  const Eigen::Matrix2d measurement_covariance = measurement_sigma.cwiseAbs2().asDiagonal();
+
+  std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> landmarks;
+  for (std::size_t i = 0; i < count; ++i) {
+    const double a = 2 * M_PI * i / count;
+    landmarks.push_back(Eigen::Vector2d(6 * std::cos(a), 6 * std::sin(a)));
+  }
+  const int steps = static_cast<int>(laps * 2 * M_PI * 3 / kStep);
+  auto truth = [](int k) {
+    const double a = k * kStep / 3;
+    return Eigen::Vector3d(3 * std::cos(a), 3 * std::sin(a), normalize_angle(a + M_PI / 2));
+  };
+
+  PoseGraph graph(window, 50, 50, 5);
+  Eigen::Vector3d estimate = truth(0);
+  graph.add_pose(estimate);
+  max_factors = 0;
+  for (int k = 0; k < steps; ++k) {
+    if (k > 0) {
+      Eigen::Vector3d delta = relative(truth(k - 1), truth(k));
+      for (int i = 0; i < 3; ++i) {
+        delta(i) += odometry_sigma(i) * noise(rng);
+      }
+      estimate = compose(graph.pose(k - 1), delta);
+      graph.add_pose(estimate);
+      graph.add_odometry(k - 1, k, delta, odometry_covariance);
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+      const Eigen::Vector2d d = landmarks[i] - truth(k).head<2>();
+      const Eigen::Vector2d z(d.norm() + measurement_sigma(0) * noise(rng),
+                              normalize_angle(std::atan2(d.y(), d.x()) - truth(k)(2) + measurement_sigma(1) * noise(rng)));
+      if (k == 0) {
+        const double bearing = estimate(2) + z(1);
+        graph.add_landmark(estimate.head<2>() + z(0) * Eigen::Vector2d(std::cos(bearing), std::sin(bearing)));
+      }
+      graph.add_observation(k, i, z, measurement_covariance);
+    }
+    graph.update();
+    max_factors = std::max(max_factors, graph.last_system_factors());
+  }
+  landmark_error = 0;
+  for (std::size_t i = 0; i < count; ++i) {
+    landmark_error = std::max(landmark_error, (graph.landmark(i) - landmarks[i]).norm());
+  }
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  // сторона квадратного поля маяков, м
+  const double side = argc > 1 ? std::atof(argv[1]) : 120.0;
+  std::mt19937 rng(7);
+  std::normal_distribution<double> noise(0.0, 1.0);
+
+  const Eigen::Vector3d odometry_sigma(0.01, 0.01, 0.002);
+  const Eigen::Vector2d measurement_sigma(0.05, 0.005);
+  const Eigen::Matrix3d odometry_covariance = odometry_sigma.cwiseAbs2().asDiagonal();
+  const Eigen::Matrix2d measurement_covariance = measurement_sigma.cwiseAbs2().asDiagonal();
+
+  // поле маяков с шагом kSpacing
+  std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> landmarks;
+  const int per_side = static_cast<int>(side / kSpacing);
+  for (int i = 0; i < per_side; ++i) {
+    for (int j = 0; j < per_side; ++j) {
+      landmarks.push_back(Eigen::Vector2d((i + 0.5) * kSpacing, (j + 0.5) * kSpacing));
+    }
+  }
+
+  // змейка: ряды вдоль x через kRowDistance, положения через kStep
+  std::vector<Eigen::Vector3d> truth;
+  for (int row = 0; row * kRowDistance < side; ++row) {
+    const double y = (row + 0.5) * kRowDistance;
+    const bool forward = row % 2 == 0;
+    for (double s = 0; s <= side; s += kStep) {
+      truth.push_back(Eigen::Vector3d(forward ? s : side - s, y, forward ? 0.0 : M_PI));
+    }
+  }
+
+  PoseGraph graph(10, 50, 50, 5);
+  // индекс маяка в графе по истинному индексу, -1 - маяк еще не виден
+  std::vector<int> graph_landmark(landmarks.size(), -1);
+  Eigen::Vector3d estimate = truth.front();
+  graph.add_pose(estimate);
+
+  std::size_t max_update_size = 0;
+  double max_time = 0;
+  double total_time = 0;
+  for (std::size_t k = 0; k < truth.size(); ++k) {
+    if (k > 0) {
+      Eigen::Vector3d delta = relative(truth[k - 1], truth[k]);
+      for (int i = 0; i < 3; ++i) {
+        delta(i) += odometry_sigma(i) * noise(rng);
+      }
+      estimate = compose(graph.pose(k - 1), delta);
+      graph.add_pose(estimate);
+      graph.add_odometry(k - 1, k, delta, odometry_covariance);
+    }
+    for (std::size_t i = 0; i < landmarks.size(); ++i) {
+      const Eigen::Vector2d d = landmarks[i] - truth[k].head<2>();
+      if (d.norm() > kRange) {
+        continue;
+      }
+      const Eigen::Vector2d z(d.norm() + measurement_sigma(0) * noise(rng),
+                              normalize_angle(std::atan2(d.y(), d.x()) - truth[k](2) + measurement_sigma(1) * noise(rng)));
+      if (graph_landmark[i] < 0) {
+        const double bearing = estimate(2) + z(1);
+        graph_landmark[i] = graph.add_landmark(estimate.head<2>() + z(0) * Eigen::Vector2d(std::cos(bearing), std::sin(bearing)));
+      }
+      graph.add_observation(k, graph_landmark[i], z, measurement_covariance);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    graph.update();
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    total_time += elapsed;
+    max_time = std::max(max_time, elapsed);
+    max_update_size = std::max(max_update_size, graph.last_system_size());
+  }
+
+  // наибольшие ошибки положений робота и маяков
+  auto errors = [&](double& pose_error, double& landmark_error) {
+    pose_error = 0;
+    for (std::size_t k = 0; k < truth.size(); ++k) {
+      pose_error = std::max(pose_error, (graph.pose(k).head<2>() - truth[k].head<2>()).norm());
+    }
+    landmark_error = 0;
+    for (std::size_t i = 0; i < landmarks.size(); ++i) {
+      if (graph_landmark[i] >= 0) {
+        landmark_error = std::max(landmark_error, (graph.landmark(graph_landmark[i]) - landmarks[i]).norm());
+      }
+    }
+  };
+  double update_pose_error, update_landmark_error;
+  errors(update_pose_error, update_landmark_error);
+  graph.optimize();
+  double pose_error, landmark_error;
+  errors(pose_error, landmark_error);
+  const std::size_t variables = 3 * graph.pose_count() + 2 * graph.landmark_count();
+
+  std::cout << "keyframes = " << graph.pose_count() << ", landmarks = " << graph.landmark_count()
+            << ", unknowns = " << variables << std::endl;
+  std::cout << "max update system size = " << max_update_size << ", mean update = "
+            << 1e3 * total_time / truth.size() << " ms, max update = " << 1e3 * max_time << " ms" << std::endl;
+  std::cout << "updates only: max pose error = " << update_pose_error
+            << ", max landmark error = " << update_landmark_error << std::endl;
+  std::cout << "after full pass: max pose error = " << pose_error << ", max landmark error = " << landmark_error << std::endl;
+
+  std::size_t revisit_factors;
+  double revisit_error;
+  run_revisits(30, 10, revisit_factors, revisit_error);
+  std::cout << "30 laps around 12 landmarks: max update factors = " << revisit_factors
+            << ", max landmark error = " << revisit_error << std::endl;
+
+  bool ok = true;
+  // окно из 10 положений видит не больше пары сотен маяков, часть прохода добавляет около 50 переменных
+  // при любом размере поля
+  if (max_update_size > 800) {
+    std::cout << "FAIL: update system grows with the map" << std::endl;
+    ok = false;
+  }
+  // граф закреплен только первым положением, поэтому ошибка медленно растет с длиной проезда
+  if (!(update_pose_error < 1.0 && update_landmark_error < 1.0 && pose_error < 1.0 && landmark_error < 1.0)) {
+    std::cout << "FAIL: estimate is inconsistent with the ground truth" << std::endl;
+    ok = false;
+  }
+  // в окне только измерения 12 маяков из 10 его положений и одометрия между ними
+  if (revisit_factors > 10 * (12 + 1)) {
+    std::cout << "FAIL: update factors grow with landmark revisits" << std::endl;
+    ok = false;
+  }
+  if (!(revisit_error < 0.2)) {
+    std::cout << "FAIL: revisited landmarks are inconsistent with the ground truth" << std::endl;
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
@@ -45,12 +45,12 @@ void Matcher::add_feature(const sensor_msgs::LaserScan& scan, std::size_t start,
   double x_sum = 0.0;
   double y_sum = 0.0;
   std::size_t count = 0;
+  const simple_map::BeamDirections& directions = beam_directions.get(scan);
   // Цикл по точкам лидара между индексами start и finish
   for (std::size_t i = start; i <= finish; ++i) {
-    // Вычисляем преобразовние в декартовы координаты и угол
-    double angle = scan.angle_min + i * scan.angle_increment;
-    double x = scan.ranges[i] * std::cos(angle);
-    double y = scan.ranges[i] * std::sin(angle);
+    // Вычисляем преобразовние в декартовы координаты по таблице направлений лучей
+    double x = scan.ranges[i] * directions.cos[i];
+    double y = scan.ranges[i] * directions.sin[i];
 
     // Производим суммирование координат
     x_sum += x;
@@ -73,14 +73,13 @@ void Matcher::detect_features(const sensor_msgs::LaserScan& scan)
   // В цикле по лучам ищем начальный и конечный индексы лучей, падающих на одно препятствие
   // и вызываем add_feature
   const std::vector<float>& ranges = scan.ranges;
-  const float angle_increment = scan.angle_increment;
+  const simple_map::BeamDirections& directions = beam_directions.get(scan);
   // Шагаем циклом по лучам с лидара и ищем локальные минимуны, которые считаем за центр столбов
   for (std::size_t i = 1; i < ranges.size() - 1; ++i) {
     if (ranges[i] < ranges[i - 1] && ranges[i] < ranges[i + 1]) {
-      // Вычисляем угол и преобразование в декартовы координаты
-      double angle = scan.angle_min + i * angle_increment;
-      double x = ranges[i] * std::cos(angle);
-      double y = ranges[i] * std::sin(angle);
+      // Вычисляем преобразование в декартовы координаты по таблице направлений лучей
+      double x = ranges[i] * directions.cos[i];
+      double y = ranges[i] * directions.sin[i];
       
       // Добавляем обнаруженную особую точку
       new_features.push_back(Eigen::Vector2d(x, y));
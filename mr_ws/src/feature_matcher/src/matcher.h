@@ -6,6 +6,7 @@
 #include <visualization_msgs/MarkerArray.h>
 #include <nav_msgs/Odometry.h>
 #include <Eigen/Eigen>
+#include <simple_map/beam_directions.h>
 #include <vector>
 //#include <tf/transform_publisher.h>
 
@@ -60,6 +61,9 @@ private:
   // инкрементальное преобразование за последний шаг в СК карты
   Eigen::Isometry2d incremental_transform = Eigen::Isometry2d::Identity();
 
+  // таблицы направлений лучей по геометрии скана
+  simple_map::BeamDirectionCache beam_directions;
+
   tf::TransformBroadcaster br;
   // отметка времени предыдущего скана
   ros::Time last_stamp = ros::Time::now();
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace simple_map
+{
+
+/**
+ * @brief Единичные направления лучей скана для одной геометрии дальномера
+ *
+ * Направление i-го луча в СК дальномера: (cos[i], sin[i]),
+ * угол луча angle_min + i * angle_increment
+ */
+struct BeamDirections
+{
+  float angle_min = 0;
+  float angle_increment = 0;
+  std::vector<float> cos;
+  std::vector<float> sin;
+
+  std::size_t size() const { return cos.size(); }
+  bool matches(float min, float increment, std::size_t count) const
+  {
+    return angle_min == min && angle_increment == increment && cos.size() == count;
+  }
+};
+
+/**
+ * @brief Кеш таблиц направлений лучей по геометрии скана
+ *
+ * Геометрия скана (angle_min, angle_increment, число лучей) не меняется от скана к скану,
+ * поэтому синусы и косинусы углов лучей вычисляются один раз для каждой геометрии.
+ * Кеш не потокобезопасен: get вызывается из одного потока, полученная таблица
+ * может читаться из любого числа потоков.
+ */
+class BeamDirectionCache
+{
+public:
+  const BeamDirections& get(float angle_min, float angle_increment, std::size_t count)
+  {
+    for (std::size_t i = 0; i < tables.size(); ++i) {
+      if (tables[i].matches(angle_min, angle_increment, count)) {
+        return tables[i];
+      }
+    }
+    // геометрий обычно столько же, сколько дальномеров, старые таблицы вытесняются по кругу
+    if (tables.size() < kMaxTables) {
+      tables.emplace_back();
+      next = tables.size() - 1;
+    }
+    BeamDirections& table = tables[next];
+    next = (next + 1) % kMaxTables;
+
+    table.angle_min = angle_min;
+    table.angle_increment = angle_increment;
+    table.cos.resize(count);
+    table.sin.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      const double angle = angle_min + i * angle_increment;
+      table.cos[i] = std::cos(angle);
+      table.sin[i] = std::sin(angle);
+    }
+    return table;
+  }
+
+  // таблица для геометрии сообщения sensor_msgs::LaserScan
+  template <class Scan>
+  const BeamDirections& get(const Scan& scan)
+  {
+    return get(scan.angle_min, scan.angle_increment, scan.ranges.size());
+  }
+
+private:
+  static const std::size_t kMaxTables = 4;
+  std::vector<BeamDirections> tables;
+  std::size_t next = 0;
+};
+
+/**
+ * @brief Поворот таблицы направлений матрицей 2x2 [m00 m01; m10 m11]
+ *
+ * Результат записывается в массивы x, y, цикл без ветвлений векторизуется компилятором
+ */
+inline void rotate_directions(const BeamDirections& directions,
+                              float m00, float m01, float m10, float m11,
+                              std::vector<float>& x, std::vector<float>& y)
+{
+  const std::size_t count = directions.size();
+  x.resize(count);
+  y.resize(count);
+  const float* c = directions.cos.data();
+  const float* s = directions.sin.data();
+  float* out_x = x.data();
+  float* out_y = y.data();
+  for (std::size_t i = 0; i < count; ++i) {
+    out_x[i] = m00 * c[i] + m01 * s[i];
+    out_y[i] = m10 * c[i] + m11 * s[i];
+  }
+}
+
+/**
+ * @brief Перевод дальностей скана в декартовы координаты в СК дальномера
+ */
+inline void ranges_to_points(const BeamDirections& directions, const std::vector<float>& ranges,
+                             std::vector<float>& x, std::vector<float>& y)
+{
+  rotate_directions(directions, 1, 0, 0, 1, x, y);
+  const std::size_t count = directions.size();
+  for (std::size_t i = 0; i < count; ++i) {
+    x[i] *= ranges[i];
+    y[i] *= ranges[i];
+  }
+}
+
+}  // namespace simple_map
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace simple_map
+{
+
+/**
+ * @brief Пул потоков для параллельной обработки данных внутри одного callback
+ *
+ * Потоки создаются один раз при создании пула. Вызов parallel_for раздает задачи
+ * потокам пула и ждет их завершения, вызывающий поток также выполняет задачи.
+ * Заголовочный, чтобы пул использовали и другие пакеты без библиотеки simple_map.
+ */
+class ThreadPool
+{
+public:
+  // threads - общее число потоков, включая вызывающий
+  explicit ThreadPool(std::size_t threads)
+  {
+    for (std::size_t i = 1; i < threads; ++i) {
+      workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+  }
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    start_cv.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // число потоков, выполняющих задачи
+  std::size_t size() const { return workers.size() + 1; }
+
+  // выполняет task(i) для всех i из [0, tasks) и возвращает управление после завершения всех задач
+  void parallel_for(std::size_t tasks, const std::function<void(std::size_t)>& task)
+  {
+    if (workers.empty() || tasks < 2) {
+      for (std::size_t i = 0; i < tasks; ++i) {
+        task(i);
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      current_task = &task;
+      task_count = tasks;
+      next_task = 0;
+      busy_workers = workers.size();
+      ++generation;
+    }
+    start_cv.notify_all();
+    run_tasks();
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return busy_workers == 0; });
+    current_task = nullptr;
+  }
+
+private:
+  void worker_loop()
+  {
+    std::size_t last_generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        start_cv.wait(lock, [&] { return stop || generation != last_generation; });
+        if (stop) {
+          return;
+        }
+        last_generation = generation;
+      }
+      run_tasks();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        --busy_workers;
+      }
+      done_cv.notify_one();
+    }
+  }
+
+  // выполнение задач текущего пакета, пока они не закончатся
+  void run_tasks()
+  {
+    for (std::size_t i = next_task++; i < task_count; i = next_task++) {
+      (*current_task)(i);
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  // сигнал потокам о новом пакете задач или завершении работы
+  std::condition_variable start_cv;
+  // сигнал вызывающему потоку о завершении пакета
+  std::condition_variable done_cv;
+
+  // текущий пакет задач
+  const std::function<void(std::size_t)>* current_task = nullptr;
+  std::size_t task_count = 0;
+  std::atomic<std::size_t> next_task{0};
+  // число потоков пула, еще работающих над текущим пакетом
+  std::size_t busy_workers = 0;
+  // номер пакета, чтобы потоки не выполняли один пакет дважды
+  std::size_t generation = 0;
+  bool stop = false;
+};
+
+}  // namespace simple_map
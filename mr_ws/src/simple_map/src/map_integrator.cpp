@@ -0,0 +1,291 @@
+#include "map_integrator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+MapIntegrator::MapIntegrator(simple_map::ThreadPool& pool, const IntegrationParams& params) :
+  pool(pool),
+  params_(params)
+{
+}
+
+void MapIntegrator::update_cell(float& l, bool occupied) const
+{
+  if(params_.use_bayes)
+  {
+    // Bayes: обновление сводится к сложению с ограничением диапазона
+    l = std::min<float>(std::max<float>(l + (occupied ? params_.log_odds_hit : params_.log_odds_miss),
+                                        params_.log_odds_min),
+                        params_.log_odds_max);
+  }
+  else
+  {
+    // Non-Bayes
+    l = occupied ? params_.log_odds_max : params_.log_odds_min;
+  }
+}
+
+void MapIntegrator::decay_tile(TiledMap::Tile& tile) const
+{
+  if (tile.stamp == 0)
+  {
+    // новый или загруженный тайл: отсчет затухания начинается с текущего скана
+    tile.stamp = scan_time;
+    return;
+  }
+  if (!decays(tile))
+    return;
+  const float factor = std::exp(-(scan_time - tile.stamp) / params_.decay_time);
+  for (float& cell : tile.cells)
+    cell *= factor;
+  tile.stamp = scan_time;
+}
+
+/**
+ * @brief Трассировка лучей скана с номерами [begin, end) в списки обновлений ячеек
+ *
+ * Обновления раскладываются по bands полосам строк тайлов в списки band_updates[band]
+ * и записываются в порядке лучей, сама карта не изменяется,
+ * поэтому функция может выполняться для разных диапазонов лучей параллельно
+ */
+void MapIntegrator::trace_beams(const sensor_msgs::LaserScan& scan, size_t begin, size_t end,
+                                int bands, std::vector<CellUpdate>* band_updates,
+                                CellBounds& bounds,
+                                std::vector<std::pair<int, int>>& tiles) const
+{
+  const double inv_map_res{1.0 / params_.resolution};
+
+  for (int band = 0; band < bands; ++band)
+    band_updates[band].clear();
+  tiles.clear();
+  bounds = CellBounds();
+  // последний записанный тайл, соседние ячейки луча почти всегда лежат в одном тайле
+  int last_tile_x = std::numeric_limits<int>::min();
+  int last_tile_y = std::numeric_limits<int>::min();
+  std::vector<CellUpdate>* updates = band_updates;
+  for (size_t i = begin; i < end; i++)
+  {
+    float range = scan.ranges[i];
+    // NaN и бесконечность допустимы в скане (REP 117), сравнения с ними ложны, поэтому проверяются отдельно
+    if (!std::isfinite(range) || range <= scan.range_min || range >= scan.range_max)
+      continue;
+
+    // концы луча в СК карты по заранее повернутому направлению, промежуточные ячейки находим трассировкой
+    const double start_x = beam_origin_x[i] + scan.range_min * beam_dir_x[i];
+    const double start_y = beam_origin_y[i] + scan.range_min * beam_dir_y[i];
+    const double end_x = beam_origin_x[i] + range * beam_dir_x[i];
+    const double end_y = beam_origin_y[i] + range * beam_dir_y[i];
+
+    trace_ray(start_x * inv_map_res, start_y * inv_map_res,
+              end_x * inv_map_res, end_y * inv_map_res,
+              [&](int x, int y, bool is_last) -> bool
+              {
+                const int tile_x = TiledMap::tile_coord(x);
+                const int tile_y = TiledMap::tile_coord(y);
+                if (tile_x != last_tile_x || tile_y != last_tile_y)
+                {
+                  tiles.emplace_back(tile_x, tile_y);
+                  updates = &band_updates[band_of(tile_y, bands)];
+                  last_tile_x = tile_x;
+                  last_tile_y = tile_y;
+                }
+                // в конце луча препятствие, остальные ячейки свободны
+                updates->push_back(CellUpdate{x, y, is_last});
+                bounds.add(x, y);
+                return true;
+              });
+  }
+}
+
+/**
+ * @brief Обход обновлений ячеек из beam_updates, лежащих в строках тайлов полосы band
+ *
+ * Строки тайлов распределены между bands полосами по остатку от деления, обновления
+ * полосы уже разложены трассировкой в ее списки, которые обходятся в порядке групп лучей,
+ * так что каждая полоса просматривает только свои обновления. Для каждого обновления вызывается
+ * visit(cells, stamps, index, occupied), где cells и stamps - ячейки и отметки тайла
+ * (stamps равен nullptr, если with_stamps = false), index - индекс ячейки в тайле.
+ */
+template <typename UpdateVisitor>
+void MapIntegrator::for_each_band_update(size_t band, int bands, TiledMap& log_odds, bool with_stamps,
+                                         UpdateVisitor visit)
+{
+  int last_tile_x = std::numeric_limits<int>::min();
+  int last_tile_y = std::numeric_limits<int>::min();
+  TiledMap::Tile* tile = nullptr;
+  StampTile* stamps = nullptr;
+  for (size_t group = band; group < beam_updates.size(); group += bands)
+  {
+    for (const CellUpdate& update : beam_updates[group])
+    {
+      const int tile_y = TiledMap::tile_coord(update.y);
+      const int tile_x = TiledMap::tile_coord(update.x);
+      if (tile_x != last_tile_x || tile_y != last_tile_y)
+      {
+        tile = log_odds.find_tile(tile_x, tile_y);
+        // тайл обрабатывается только потоком своей полосы, поэтому затухание выполняется здесь
+        if (params_.decay_time > 0)
+          decay_tile(*tile);
+        if (with_stamps)
+          stamps = scan_stamps.find(TiledMap::tile_key(tile_x, tile_y))->second.get();
+        last_tile_x = tile_x;
+        last_tile_y = tile_y;
+      }
+      visit(tile->cells, stamps, TiledMap::cell_index(update.x, update.y), update.occupied);
+    }
+  }
+}
+
+/**
+ * @brief Положение и направление каждого луча в СК карты с учетом движения дальномера за время скана
+ *
+ * Положение дальномера в момент измерения i-го луча линейно интерполируется между
+ * положениями в начале и в конце скана, угол поворота - между углами рыскания.
+ * Все вычисления выполняются циклами без ветвлений по массивам лучей.
+ *
+ * Результат записывается в beam_origin_x/y и beam_dir_x/y.
+ */
+void MapIntegrator::deskew_beams(const simple_map::BeamDirections& directions,
+                                 const tf::Transform& start,
+                                 const tf::Transform& end)
+{
+  const size_t beams = directions.size();
+  // направления лучей поворачиваем в СК карты один раз на весь скан
+  const tf::Matrix3x3 basis = start.getBasis();
+  simple_map::rotate_directions(directions,
+                                basis.getRow(0).x(), basis.getRow(0).y(),
+                                basis.getRow(1).x(), basis.getRow(1).y(),
+                                beam_dir_x, beam_dir_y);
+
+  const tf::Vector3 start_origin = start.getOrigin();
+  const tf::Vector3 shift = end.getOrigin() - start_origin;
+  const double yaw_start = tf::getYaw(start.getRotation());
+  const double yaw_end = tf::getYaw(end.getRotation());
+  // поворот за время скана, приведенный к (-pi, pi]
+  const double yaw_shift = std::atan2(std::sin(yaw_end - yaw_start), std::cos(yaw_end - yaw_start));
+  // доля времени скана, приходящаяся на один луч
+  const float step = beams > 1 ? 1.0f / (beams - 1) : 0.0f;
+
+  beam_origin_x.resize(beams);
+  beam_origin_y.resize(beams);
+  const float sx = start_origin.x(), sy = start_origin.y();
+  const float dx = shift.x(), dy = shift.y();
+  for (size_t i = 0; i < beams; ++i)
+  {
+    beam_origin_x[i] = sx + i * step * dx;
+    beam_origin_y[i] = sy + i * step * dy;
+  }
+
+  if (yaw_shift == 0)
+    return;
+  for (size_t i = 0; i < beams; ++i)
+  {
+    const float angle = i * step * yaw_shift;
+    const float c = std::cos(angle);
+    const float s = std::sin(angle);
+    const float x = beam_dir_x[i];
+    const float y = beam_dir_y[i];
+    beam_dir_x[i] = c * x - s * y;
+    beam_dir_y[i] = s * x + c * y;
+  }
+}
+
+// Интеграция выполняется в два параллельных этапа:
+// 1. лучи делятся на последовательные группы, каждая группа трассируется в свой список обновлений;
+//    после этого последовательно создаются тайлы, через которые прошли лучи;
+// 2. строки тайлов распределяются между потоками, каждый поток применяет к своим тайлам
+//    обновления из всех списков в порядке лучей.
+// Каждая ячейка изменяется только одним потоком и в том же порядке, что и при
+// последовательной обработке лучей, поэтому результат совпадает с последовательной интеграцией.
+// В режиме PerCell на втором этапе ячейки сначала отмечаются как пройденные или занятые,
+// затем каждая отмеченная ячейка обновляется один раз.
+void MapIntegrator::trace(const sensor_msgs::LaserScan& scan,
+                          const tf::Transform& start,
+                          const tf::Transform& end)
+{
+  const size_t beams = scan.ranges.size();
+  scan_time = scan.header.stamp.toSec();
+  deskew_beams(beam_directions.get(scan), start, end);
+
+  // групп лучей больше, чем потоков, для выравнивания нагрузки
+  const size_t groups = std::max<size_t>(1, std::min(beams, pool.size() * 4));
+  // обновления сразу раскладываются по полосам второго этапа
+  band_count = pool.size();
+  beam_updates.resize(groups * band_count);
+  beam_bounds.resize(groups);
+  beam_tiles.resize(groups);
+  pool.parallel_for(groups, [&](size_t group)
+  {
+    trace_beams(scan, beams * group / groups, beams * (group + 1) / groups,
+                band_count, &beam_updates[group * band_count], beam_bounds[group], beam_tiles[group]);
+  });
+}
+
+void MapIntegrator::apply(TiledMap& log_odds, CellBounds& dirty)
+{
+  for (size_t group = 0; group < beam_tiles.size(); ++group)
+  {
+    dirty.add(beam_bounds[group]);
+    // создание тайлов меняет хеш-таблицы карты и отметок, поэтому выполняется до параллельного этапа
+    for (const auto& tile : beam_tiles[group])
+    {
+      // затухание меняет все ячейки тайла, а не только пройденные лучами
+      if (decays(log_odds.get_tile(tile.first, tile.second)))
+      {
+        dirty.add(tile.first * TILE_SIZE, tile.second * TILE_SIZE);
+        dirty.add(tile.first * TILE_SIZE + TILE_SIZE - 1, tile.second * TILE_SIZE + TILE_SIZE - 1);
+      }
+      if (params_.mode == IntegrationMode::PerCell)
+      {
+        std::unique_ptr<StampTile>& stamps = scan_stamps[TiledMap::tile_key(tile.first, tile.second)];
+        if (!stamps)
+          stamps.reset(new StampTile);
+      }
+    }
+  }
+
+  const int bands = band_count;
+  if (params_.mode == IntegrationMode::PerBeam)
+  {
+    pool.parallel_for(bands, [&](size_t band)
+    {
+      for_each_band_update(band, bands, log_odds, false,
+                           [&](float* cells, StampTile*, int index, bool occupied)
+                           {
+                             update_cell(cells[index], occupied);
+                           });
+    });
+    return;
+  }
+
+  // PerCell: сначала отмечаем ячейки скана и запоминаем каждую ячейку один раз,
+  // затем обновляем запомненные ячейки по итоговой отметке
+  const uint16_t passed = scan_generation;
+  const uint16_t hit = scan_generation + 1;
+  band_cells.resize(bands);
+  pool.parallel_for(bands, [&](size_t band)
+  {
+    std::vector<ScanCell>& cells = band_cells[band];
+    cells.clear();
+    for_each_band_update(band, bands, log_odds, true,
+                         [&](float* tile_cells, StampTile* stamps, int index, bool occupied)
+                         {
+                           uint16_t& stamp = stamps->stamps[index];
+                           if (stamp < passed)
+                             cells.push_back(ScanCell{&tile_cells[index], &stamp});
+                           stamp = std::max<uint16_t>(stamp, occupied ? hit : passed);
+                         });
+    for (const ScanCell& cell : cells)
+      update_cell(*cell.value, *cell.stamp == hit);
+  });
+
+  if (scan_generation > std::numeric_limits<uint16_t>::max() - 4)
+  {
+    // поколения закончились: сбрасываем отметки, это происходит раз в 32 тысячи сканов
+    for (auto& item : scan_stamps)
+      std::fill(std::begin(item.second->stamps), std::end(item.second->stamps), 0);
+    scan_generation = 0;
+  }
+  scan_generation += 2;
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <sensor_msgs/LaserScan.h>
+#include <tf/transform_datatypes.h>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <simple_map/beam_directions.h>
+#include <simple_map/thread_pool.h>
+
+#include "tiled_map.h"
+
+// режим интеграции скана
+enum class IntegrationMode
+{
+  // каждый луч обновляет все ячейки, через которые прошел
+  PerBeam,
+  // каждая ячейка обновляется не более одного раза за скан, попадание луча важнее прохода
+  PerCell
+};
+
+// параметры обновления карты сканом
+struct IntegrationParams
+{
+  // разрешение карты, м
+  double resolution = 0.1;
+  bool use_bayes = true;
+  IntegrationMode mode = IntegrationMode::PerBeam;
+  // приращения логарифма отношения шансов для ячейки с концом луча и ячейки, через которую луч прошел
+  float log_odds_hit = 0;
+  float log_odds_miss = 0;
+  // границы логарифма отношения шансов, чтобы карта оставалась способной меняться
+  float log_odds_min = -2.0f;
+  float log_odds_max = 3.5f;
+  // время, за которое логарифм отношения шансов затухает к 0 в e раз, с (0 - без затухания).
+  // Затухание применяется к тайлу при обновлении его сканом, по времени с прошлого обновления
+  double decay_time = 0;
+};
+
+/**
+ * @brief Трассировка луча по ячейкам карты (алгоритм Amanatides-Woo)
+ *
+ * Координаты начала и конца луча задаются в ячейках карты (дробные значения).
+ * Каждая ячейка, которую пересекает отрезок, посещается ровно один раз,
+ * последней посещается ячейка конца луча.
+ *
+ * @param visit функтор visit(x, y, is_last), возвращает false для прекращения трассировки
+ */
+template <typename CellVisitor>
+void trace_ray(double x0, double y0, double x1, double y1, CellVisitor visit)
+{
+  int x = static_cast<int>(std::floor(x0));
+  int y = static_cast<int>(std::floor(y0));
+  const int end_x = static_cast<int>(std::floor(x1));
+  const int end_y = static_cast<int>(std::floor(y1));
+
+  const double dx = x1 - x0;
+  const double dy = y1 - y0;
+  const int step_x = dx > 0 ? 1 : -1;
+  const int step_y = dy > 0 ? 1 : -1;
+  const double inf = std::numeric_limits<double>::infinity();
+  // приращение параметра луча при переходе через одну ячейку
+  const double t_delta_x = dx != 0 ? std::abs(1.0 / dx) : inf;
+  const double t_delta_y = dy != 0 ? std::abs(1.0 / dy) : inf;
+  // значение параметра луча на ближайшей границе ячейки
+  double t_max_x = dx != 0 ? (dx > 0 ? (x + 1 - x0) : (x0 - x)) * t_delta_x : inf;
+  double t_max_y = dy != 0 ? (dy > 0 ? (y + 1 - y0) : (y0 - y)) * t_delta_y : inf;
+
+  // число переходов между ячейками известно заранее
+  for (int n = std::abs(end_x - x) + std::abs(end_y - y); n > 0; --n)
+  {
+    if (!visit(x, y, false))
+      return;
+    if (t_max_x < t_max_y)
+    {
+      x += step_x;
+      t_max_x += t_delta_x;
+    }
+    else
+    {
+      y += step_y;
+      t_max_y += t_delta_y;
+    }
+  }
+  visit(end_x, end_y, true);
+}
+
+/**
+ * @brief Обновление карты логарифмов отношения шансов сканами дальномера
+ *
+ * Хранит буферы, переиспользуемые между сканами, поэтому один объект
+ * должен использоваться одним потоком (параллельность - внутри integrate через пул потоков).
+ * Интеграция разделена на трассировку лучей, которая не обращается к карте, и
+ * обновление карты, поэтому несколько объектов с разными пулами могут трассировать
+ * сканы одновременно, а к общей карте обращаться по очереди.
+ */
+class MapIntegrator
+{
+public:
+  MapIntegrator(simple_map::ThreadPool& pool, const IntegrationParams& params);
+
+  const IntegrationParams& params() const { return params_; }
+
+  /**
+   * @brief Интеграция скана в карту
+   *
+   * @param start трансформ от дальномера к карте на момент первого луча
+   * @param end трансформ на момент последнего луча (совпадает со start, если компенсация движения не нужна)
+   * @param dirty расширяется областью ячеек, измененных сканом
+   */
+  void integrate(const sensor_msgs::LaserScan& scan,
+                 const tf::Transform& start,
+                 const tf::Transform& end,
+                 TiledMap& log_odds,
+                 CellBounds& dirty)
+  {
+    trace(scan, start, end);
+    apply(log_odds, dirty);
+  }
+
+  // первый этап интеграции: трассировка лучей скана в списки обновлений ячеек, карта не изменяется
+  void trace(const sensor_msgs::LaserScan& scan,
+             const tf::Transform& start,
+             const tf::Transform& end);
+  // второй этап интеграции: применение обновлений последнего трассированного скана к карте
+  void apply(TiledMap& log_odds, CellBounds& dirty);
+
+private:
+  // обновление одной ячейки карты, полученное трассировкой луча
+  struct CellUpdate
+  {
+    int x;
+    int y;
+    bool occupied;
+  };
+  // отметки ячеек тайла, которых коснулся текущий скан (режим PerCell)
+  struct StampTile
+  {
+    std::uint16_t stamps[TILE_SIZE * TILE_SIZE] = {};
+  };
+  // ячейка, которой коснулся текущий скан
+  struct ScanCell
+  {
+    float* value;
+    std::uint16_t* stamp;
+  };
+
+  void update_cell(float& l, bool occupied) const;
+  // затухание значений тайла ко времени текущего скана
+  void decay_tile(TiledMap::Tile& tile) const;
+  // меняет ли затухание значения тайла при обновлении текущим сканом
+  bool decays(const TiledMap::Tile& tile) const
+  {
+    // сканы разных дальномеров могут приходить не по порядку времени
+    return params_.decay_time > 0 && tile.stamp != 0 && scan_time > tile.stamp;
+  }
+  void trace_beams(const sensor_msgs::LaserScan& scan, std::size_t begin, std::size_t end,
+                   int bands, std::vector<CellUpdate>* band_updates,
+                   CellBounds& bounds,
+                   std::vector<std::pair<int, int>>& tiles) const;
+  void deskew_beams(const simple_map::BeamDirections& directions,
+                    const tf::Transform& start,
+                    const tf::Transform& end);
+  // полоса, к которой относится строка тайлов tile_y
+  static int band_of(int tile_y, int bands) { return ((tile_y % bands) + bands) % bands; }
+  template <typename UpdateVisitor>
+  void for_each_band_update(std::size_t band, int bands, TiledMap& log_odds, bool with_stamps,
+                            UpdateVisitor visit);
+
+  simple_map::ThreadPool& pool;
+  IntegrationParams params_;
+
+  // списки обновлений ячеек для групп лучей, разложенные по полосам строк тайлов:
+  // элемент group * bands + band, переиспользуются между сканами
+  std::vector<std::vector<CellUpdate>> beam_updates;
+  // число полос последнего трассированного скана
+  int band_count = 1;
+  // области изменений для групп лучей
+  std::vector<CellBounds> beam_bounds;
+  // тайлы, через которые прошли лучи группы (x, y тайла)
+  std::vector<std::vector<std::pair<int, int>>> beam_tiles;
+
+  // отметки хранятся для тех же тайлов, что и карта, и переиспользуются между сканами
+  std::unordered_map<std::uint64_t, std::unique_ptr<StampTile>> scan_stamps;
+  // поколение отметок текущего скана, увеличивается на 2 с каждым сканом:
+  // scan_generation - через ячейку прошел луч, +1 - в ячейку попал луч.
+  // Отметки прошлых сканов меньше scan_generation, поэтому очищать их не нужно
+  std::uint16_t scan_generation = 2;
+  // ячейки скана для каждой полосы строк тайлов, переиспользуются между сканами
+  std::vector<std::vector<ScanCell>> band_cells;
+
+  // время текущего скана, с
+  double scan_time = 0;
+
+  // таблицы направлений лучей по геометрии скана
+  simple_map::BeamDirectionCache beam_directions;
+  // направления лучей текущего скана в СК карты
+  std::vector<float> beam_dir_x;
+  std::vector<float> beam_dir_y;
+  // положения дальномера в СК карты в момент измерения каждого луча
+  std::vector<float> beam_origin_x;
+  std::vector<float> beam_origin_y;
+};
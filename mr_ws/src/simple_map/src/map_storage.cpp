@@ -0,0 +1,242 @@
+#include "map_storage.h"
+
+#include <roslz4/lz4s.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <vector>
+
+namespace
+{
+
+struct MapFileHeader
+{
+  char magic[4];
+  std::uint32_t version;
+  double resolution;
+  std::uint32_t tile_size;
+  std::uint32_t tile_count;
+  std::uint32_t flags;
+  std::uint32_t reserved;
+};
+
+struct MapFileTileEntry
+{
+  std::int32_t tile_x;
+  std::int32_t tile_y;
+  // смещение данных тайла от начала файла и их размер в байтах
+  std::uint64_t offset;
+  std::uint32_t size;
+  std::uint32_t reserved;
+};
+
+const std::size_t TILE_BYTES = sizeof(TiledMap::Tile::cells);
+
+// сжатие одного тайла, возвращает false если сжатый тайл не меньше исходного
+bool compress_tile(const TiledMap::Tile& tile, std::vector<char>& buffer, unsigned& size)
+{
+  buffer.resize(TILE_BYTES);
+  size = buffer.size();
+  // 4 - минимальный размер блока LZ4 (64 КБ), тайл помещается в один блок
+  const int result = roslz4_buffToBuffCompress(
+      reinterpret_cast<char*>(const_cast<float*>(tile.cells)), TILE_BYTES,
+      buffer.data(), &size, 4);
+  return result == ROSLZ4_OK && size < TILE_BYTES;
+}
+
+// RAII-обертка над открытым на чтение файлом
+class InputFile
+{
+public:
+  bool open(const std::string& path, std::string& error)
+  {
+    file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+      error = "can not open " + path + ": " + std::strerror(errno);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+      error = "can not stat " + path + ": " + std::strerror(errno);
+      return false;
+    }
+    size = st.st_size;
+    if (size == 0) {
+      error = path + " is empty";
+      return false;
+    }
+    return true;
+  }
+  // чтение bytes байт со смещения offset
+  bool read(std::uint64_t offset, void* buffer, std::size_t bytes)
+  {
+    if (std::fseek(file, static_cast<long>(offset), SEEK_SET) != 0) {
+      return false;
+    }
+    return std::fread(buffer, bytes, 1, file) == 1;
+  }
+  ~InputFile()
+  {
+    if (file) {
+      std::fclose(file);
+    }
+  }
+
+  FILE* file = nullptr;
+  std::size_t size = 0;
+};
+
+}  // namespace
+
+bool save_map(const TiledMap& map, double resolution, const std::string& path,
+              bool compress, std::string& error)
+{
+  MapFileHeader header;
+  std::memcpy(header.magic, MAP_FILE_MAGIC, sizeof(header.magic));
+  header.version = MAP_FILE_VERSION;
+  header.resolution = resolution;
+  header.tile_size = TILE_SIZE;
+  header.tile_count = map.tile_count();
+  header.flags = compress ? MAP_FILE_LZ4 : 0;
+  header.reserved = 0;
+
+  // сначала готовим таблицу тайлов и их данные, затем пишем файл одним проходом
+  std::vector<MapFileTileEntry> entries;
+  std::vector<const char*> payloads;
+  std::vector<std::vector<char>> compressed;
+  entries.reserve(header.tile_count);
+  payloads.reserve(header.tile_count);
+  if (compress) {
+    compressed.reserve(header.tile_count);
+  }
+  std::uint64_t offset = sizeof(MapFileHeader) + header.tile_count * sizeof(MapFileTileEntry);
+  map.for_each_tile([&](int tile_x, int tile_y, const TiledMap::Tile& tile)
+  {
+    MapFileTileEntry entry;
+    entry.tile_x = tile_x;
+    entry.tile_y = tile_y;
+    entry.offset = offset;
+    entry.size = TILE_BYTES;
+    entry.reserved = 0;
+    const char* payload = reinterpret_cast<const char*>(tile.cells);
+    unsigned compressed_size = 0;
+    if (compress) {
+      compressed.emplace_back();
+      // плохо сжимаемые тайлы хранятся как есть, размер равный TILE_BYTES означает несжатый тайл
+      if (compress_tile(tile, compressed.back(), compressed_size)) {
+        payload = compressed.back().data();
+        entry.size = compressed_size;
+      }
+    }
+    entries.push_back(entry);
+    payloads.push_back(payload);
+    offset += entry.size;
+  });
+
+  // пишем во временный файл и переименовываем, чтобы не испортить предыдущую карту
+  const std::string tmp_path = path + ".tmp";
+  FILE* file = std::fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    error = "can not open " + tmp_path + ": " + std::strerror(errno);
+    return false;
+  }
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && (entries.empty() ||
+              std::fwrite(entries.data(), sizeof(MapFileTileEntry), entries.size(), file) == entries.size());
+  for (std::size_t i = 0; ok && i < entries.size(); ++i) {
+    ok = std::fwrite(payloads[i], entries[i].size, 1, file) == 1;
+  }
+  ok = (std::fclose(file) == 0) && ok;
+  if (!ok) {
+    error = "can not write " + tmp_path + ": " + std::strerror(errno);
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    error = "can not rename " + tmp_path + " to " + path + ": " + std::strerror(errno);
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool load_map(const std::string& path, float value_min, float value_max,
+              TiledMap& map, double& resolution, std::string& error)
+{
+  InputFile file;
+  if (!file.open(path, error)) {
+    return false;
+  }
+  if (file.size < sizeof(MapFileHeader)) {
+    error = path + " is too small for a map file";
+    return false;
+  }
+  MapFileHeader header;
+  if (!file.read(0, &header, sizeof(header))) {
+    error = "can not read " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  if (std::memcmp(header.magic, MAP_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != MAP_FILE_VERSION) {
+    error = path + " is not a simple_map file of version " + std::to_string(MAP_FILE_VERSION);
+    return false;
+  }
+  if (header.tile_size != TILE_SIZE) {
+    error = path + " has tile size " + std::to_string(header.tile_size) +
+            ", expected " + std::to_string(TILE_SIZE);
+    return false;
+  }
+  const std::uint64_t table_end = sizeof(MapFileHeader) +
+                                  static_cast<std::uint64_t>(header.tile_count) * sizeof(MapFileTileEntry);
+  if (table_end > file.size) {
+    error = path + " is truncated";
+    return false;
+  }
+  std::vector<MapFileTileEntry> entries(header.tile_count);
+  if (!entries.empty() &&
+      !file.read(sizeof(MapFileHeader), entries.data(), entries.size() * sizeof(MapFileTileEntry))) {
+    error = "can not read " + path + ": " + std::strerror(errno);
+    return false;
+  }
+
+  // несжатые тайлы читаются сразу в ячейки тайла, сжатые - через общий буфер
+  TiledMap loaded;
+  std::vector<char> compressed;
+  for (std::uint32_t i = 0; i < header.tile_count; ++i) {
+    const MapFileTileEntry& entry = entries[i];
+    if (entry.offset < table_end || entry.size > TILE_BYTES || entry.offset + entry.size > file.size) {
+      error = path + " has an invalid tile entry " + std::to_string(i);
+      return false;
+    }
+    TiledMap::Tile& tile = loaded.get_tile(entry.tile_x, entry.tile_y);
+    char* cells = reinterpret_cast<char*>(tile.cells);
+    if (entry.size == TILE_BYTES) {
+      if (!file.read(entry.offset, cells, TILE_BYTES)) {
+        error = "can not read " + path + ": " + std::strerror(errno);
+        return false;
+      }
+    } else {
+      compressed.resize(entry.size);
+      unsigned size = TILE_BYTES;
+      if (!(header.flags & MAP_FILE_LZ4) || !file.read(entry.offset, compressed.data(), entry.size) ||
+          roslz4_buffToBuffDecompress(compressed.data(), entry.size, cells, &size) != ROSLZ4_OK ||
+          size != TILE_BYTES) {
+        error = path + " has a corrupted tile " + std::to_string(i);
+        return false;
+      }
+    }
+    // карта могла быть сохранена с другими границами или испорчена, а таблица вероятностей
+    // рассчитана только на текущий диапазон значений
+    for (float& cell : tile.cells) {
+      cell = std::isnan(cell) ? 0.0f : std::min(std::max(cell, value_min), value_max);
+    }
+  }
+  map = std::move(loaded);
+  resolution = header.resolution;
+  return true;
+}
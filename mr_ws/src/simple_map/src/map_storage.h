@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+#include "tiled_map.h"
+
+/**
+ * Бинарный формат файла карты (порядок байт - как на машине, сохранившей карту):
+ * MapFileHeader
+ * MapFileTileEntry x tile_count - таблица тайлов
+ * данные тайлов: TILE_SIZE x TILE_SIZE значений float, при флаге MAP_FILE_LZ4
+ * каждый тайл сжат отдельно
+ */
+const char MAP_FILE_MAGIC[4] = {'S', 'M', 'A', 'P'};
+const unsigned MAP_FILE_VERSION = 1;
+// флаг сжатия тайлов алгоритмом LZ4
+const unsigned MAP_FILE_LZ4 = 1;
+
+// сохранение карты в файл path; при ошибке возвращает false и описание в error
+bool save_map(const TiledMap& map, double resolution, const std::string& path,
+              bool compress, std::string& error);
+
+// загрузка карты из файла path, тайлы читаются сразу в ячейки карты;
+// значения ячеек ограничиваются диапазоном [value_min, value_max] текущих границ логарифма
+// отношения шансов, поврежденные значения (NaN) считаются неизвестными (0);
+// при ошибке возвращает false и описание в error, map при этом не изменяется
+bool load_map(const std::string& path, float value_min, float value_max,
+              TiledMap& map, double& resolution, std::string& error);
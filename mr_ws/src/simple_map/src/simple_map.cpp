@@ -1,67 +1,173 @@
 #include <ros/ros.h>
 #include <sensor_msgs/LaserScan.h>
 #include <nav_msgs/OccupancyGrid.h>
-#include <tf/transform_listener.h>
-
-//глобальная переменная - публикатор сообщения карты
-ros::Publisher mapPub;
-
-//глоабльный указатель на tfListener, который будет проинициализирован в main
-tf::TransformListener *tfListener;
+#include <map_msgs/OccupancyGridUpdate.h>
+#include <std_srvs/Trigger.h>
+#include <tf/transform_datatypes.h>
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/transform_listener.h>
+#include <tf2_ros/message_filter.h>
+#include <message_filters/subscriber.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <simple_map/thread_pool.h>
+
+#include "map_integrator.h"
+#include "map_storage.h"
+#include "tiled_map.h"
+
+//глобальный указатель на буфер трансформов tf2, который будет проинициализирован в main
+tf2_ros::Buffer *tfBuffer;
+
+// максимальный размер очереди, при переполнении отбрасываются самые старые сканы
+int scan_queue_size = 10;
+
+// счетчики сканов
+std::atomic<std::size_t> scans_integrated{0};
+// отброшены фильтром: трансформ так и не стал доступен
+std::atomic<std::size_t> scans_dropped_tf{0};
+// отброшены из-за переполнения очереди интеграции
+std::atomic<std::size_t> scans_dropped_queue{0};
+
+// защищает карту и сообщение карты: интеграция выполняется в отдельном потоке,
+// а публикация по таймеру и при подключении подписчика - в потоке ros::spin
+std::mutex map_mutex;
 
 //имя для СК карты
 std::string map_frame;
 
 //разрешение карты
 double map_resolution = 0.1;
-//размер карты в клетках
-int map_width = 2000;
-int map_height = 2000;
 
 bool USE_BAYES = true;
 
+// режим интеграции скана (параметр integration_mode)
+IntegrationMode integration_mode = IntegrationMode::PerBeam;
+
+// обратная модель датчика: вероятность занятости ячейки с концом луча и ячейки, через которую луч прошел
+double p_hit = 0.7;
+double p_miss = 0.4;
+// границы логарифма отношения шансов, чтобы карта оставалась способной меняться
+double log_odds_min = -2.0;
+double log_odds_max = 3.5;
+// время затухания логарифма отношения шансов к 0 в e раз, с (0 - без затухания),
+// чтобы следы движущихся препятствий исчезали с карты
+double decay_time = 0;
+
+// приращения логарифма отношения шансов, вычисляются из p_hit и p_miss
+float log_odds_hit;
+float log_odds_miss;
 
-//создаем сообщение карты
-nav_msgs::OccupancyGrid map_msg;
+// размер таблицы перевода логарифма отношения шансов в вероятность
+const int PROBABILITY_LUT_SIZE = 1024;
+// таблица перевода логарифма отношения шансов в значения OccupancyGrid (0..100)
+std::vector<int8_t> probability_lut;
 
-void prepareMapMessage(nav_msgs::OccupancyGrid& map_msg)
+// число потоков интеграции (0 - по числу ядер), делятся поровну между дальномерами
+int integration_threads = 0;
+
+/**
+ * @brief Дальномер: очередь его сканов и поток их интеграции
+ *
+ * У каждого дальномера свой пул потоков и свои буферы интеграции, поэтому лучи сканов
+ * разных дальномеров трассируются одновременно, а карта обновляется по очереди под map_mutex.
+ */
+struct Sensor
+{
+    // топик сканов, СК дальномера берется из заголовка скана
+    std::string topic;
+    // сканы, для которых уже доступен трансформ, ожидающие интеграции в карту
+    std::deque<sensor_msgs::LaserScanConstPtr> queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::unique_ptr<simple_map::ThreadPool> pool;
+    std::unique_ptr<MapIntegrator> integrator;
+    std::thread worker;
+};
+// дальномеры, заполняются в main до запуска потоков
+std::vector<std::unique_ptr<Sensor>> sensors;
+
+// карта в виде логарифма отношения шансов - основное хранилище состояния,
+// значение 0 соответствует неизвестной ячейке (p = 0.5)
+TiledMap log_odds_map;
+
+// публикуемая карта: сообщение, опубликованная область и публикаторы
+struct MapOutput
+{
+    nav_msgs::OccupancyGrid msg;
+    // область карты в последнем опубликованном полном сообщении, участки изменений публикуются относительно нее
+    CellBounds published_bounds;
+    // публикатор полной карты
+    ros::Publisher pub;
+    // публикатор изменившихся за скан участков карты
+    ros::Publisher update_pub;
+};
+
+//публикация карты исходного разрешения
+MapOutput map_output;
+
+// уровень пирамиды карт пониженного разрешения
+struct PyramidLevel
+{
+    // ячейка уровня соответствует scale x scale ячейкам исходной карты
+    int scale;
+    // максимум логарифма отношения шансов по известным ячейкам предыдущего уровня
+    TiledMap map;
+    MapOutput output;
+};
+// число уровней пирамиды, разрешение каждого следующего уровня в 2 раза меньше
+int pyramid_levels = 3;
+std::vector<PyramidLevel> pyramid;
+
+//файл, в который сохраняется карта по вызову сервиса save_map
+std::string map_file = "simple_map.smap";
+//сжимать ли тайлы карты при сохранении
+bool map_compression = true;
+
+//частота публикации полной карты, Гц (изменения публикуются с каждым сканом)
+double full_map_rate = 0.2;
+
+// компенсация движения дальномера за время скана
+bool deskew = true;
+// сколько фильтр ждет трансформ после stamp скана, чтобы был доступен трансформ на конец скана, с
+double scan_duration = 0.1;
+
+void prepareMapMessage(nav_msgs::OccupancyGrid& map_msg, double resolution)
 {
     map_msg.header.frame_id = map_frame;
-    
-    map_msg.info.height = map_height;
-    map_msg.info.width = map_width;
-    map_msg.info.resolution = map_resolution;
-    // фиксированное положение начала карты (левый нижний угол)
-    map_msg.info.origin.position.x = - map_width * map_resolution /2.0;
-    map_msg.info.origin.position.y = - 10.0;
-
-    // изменяем размер вектора, который является хранилищем данных карты, и заполняем его значением (-1) - неизвестное значение
-    map_msg.data.resize(map_height*map_width, -1);
+    map_msg.info.resolution = resolution;
+    // размер и положение начала карты определяются при публикации по созданным тайлам
+    map_msg.info.width = 0;
+    map_msg.info.height = 0;
 }
 
+// report_errors = false для запросов, отсутствие трансформа для которых ожидаемо и обрабатывается вызывающим
 bool determineScanTransform(tf::StampedTransform& scanTransform,
                             const ros::Time& stamp,
-                            const std::string& laser_frame)
+                            const std::string& laser_frame,
+                            bool report_errors = true)
 {
+    // трансформ уже проверен фильтром сообщений, поэтому запрос не блокирует поток
     try
     {
-        if ( ! tfListener->waitForTransform(map_frame,
-                                            laser_frame,
-                                            stamp,
-                                            ros::Duration(0.1)) )
-        {
-          ROS_WARN_STREAM("no transform to scan "<<laser_frame);
-          return false;
-        }
-        tfListener->lookupTransform(map_frame,
-                                    laser_frame,
-                                    stamp,
-                                    scanTransform);
-
+        geometry_msgs::TransformStamped transform = tfBuffer->lookupTransform(map_frame,
+                                                                              laser_frame,
+                                                                              stamp);
+        tf::transformMsgToTF(transform.transform, scanTransform);
     }
-    catch (tf::TransformException& e)
+    catch (tf2::TransformException& e)
     {
-        ROS_ERROR_STREAM("got tf exception "<<e.what());
+        if (report_errors)
+            ROS_ERROR_STREAM("got tf exception "<<e.what());
         return false;
     }
     return true;
@@ -77,68 +183,242 @@ float calc_p(float l)
     return 1 - (1/(1+exp(l)));
 }
 
-int get_map(float l)
+void prepareProbabilityLut()
 {
-    float p = calc_p(l);
-if (p < 0.4) { 
-        return 0;
+    log_odds_hit = log2p(p_hit) - log2p(0.5);
+    log_odds_miss = log2p(p_miss) - log2p(0.5);
+
+    probability_lut.resize(PROBABILITY_LUT_SIZE);
+    for (int i = 0; i < PROBABILITY_LUT_SIZE; ++i)
+    {
+        float l = log_odds_min + (log_odds_max - log_odds_min) * i / (PROBABILITY_LUT_SIZE - 1);
+        probability_lut[i] = static_cast<int8_t>(std::lround(calc_p(l) * 100));
     }
-else if (p > 0.6) { return 100; }
-else return 50;
 }
 
-void create_map(const sensor_msgs::LaserScan& scan, 
-    tf::StampedTransform& scanTransform,
-    nav_msgs::OccupancyGrid& map_msg,
-    bool use_bayes)
+inline int8_t toOccupancy(float l, float lut_scale)
 {
-    float inv_map_res{1.0 / map_resolution};
-    for (size_t i = 0; i < scan.ranges.size(); i++)
+    return l == 0 ? -1 : probability_lut[static_cast<int>((l - log_odds_min) * lut_scale + 0.5f)];
+}
+
+/**
+ * @brief Перевод области карты логарифмов отношения шансов в значения OccupancyGrid
+ *
+ * Копирование выполняется по тайлам, ячейки несозданных тайлов заполняются значением (-1)
+ *
+ * @param region область ячеек карты
+ * @param data массив размером region.width() x region.height()
+ */
+void copyRegion(const TiledMap& log_odds, const CellBounds& region, int8_t* data)
+{
+    const float lut_scale = (PROBABILITY_LUT_SIZE - 1) / (log_odds_max - log_odds_min);
+    const int region_width = region.width();
+    for (int tile_y = TiledMap::tile_coord(region.min_y); tile_y <= TiledMap::tile_coord(region.max_y); ++tile_y)
     {
-        float curr_angle = scan.angle_min + i * scan.angle_increment;
-        float range = scan.ranges[i];
-        if(range <= scan.range_min || range >= scan.range_max )
-            continue;
+        const int y_begin = std::max(region.min_y, tile_y * TILE_SIZE);
+        const int y_end = std::min(region.max_y + 1, (tile_y + 1) * TILE_SIZE);
+        for (int tile_x = TiledMap::tile_coord(region.min_x); tile_x <= TiledMap::tile_coord(region.max_x); ++tile_x)
+        {
+            const int x_begin = std::max(region.min_x, tile_x * TILE_SIZE);
+            const int x_end = std::min(region.max_x + 1, (tile_x + 1) * TILE_SIZE);
+            const TiledMap::Tile* tile = log_odds.find_tile(tile_x, tile_y);
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                int8_t* row = data + (y - region.min_y) * region_width - region.min_x;
+                if (!tile)
+                {
+                    std::fill(row + x_begin, row + x_end, -1);
+                    continue;
+                }
+                const float* cells = tile->cells + TiledMap::cell_index(0, y) - tile_x * TILE_SIZE;
+                for (int x = x_begin; x < x_end; ++x)
+                    row[x] = toOccupancy(cells[x], lut_scale);
+            }
+        }
+    }
+}
 
-        float r_step{0.01};
-        float cos_a{cos(curr_angle)};
-        float sin_a{sin(curr_angle)};
-        for (float r = scan.range_min; r <= range + r_step; r += r_step)
+/**
+ * @brief Перевод карты логарифмов отношения шансов в сообщение OccupancyGrid
+ *
+ * Выполняется только перед публикацией, карта обрезается по области созданных тайлов,
+ * ячейки с нулевым значением считаются неизвестными (-1)
+ */
+void fillMapMessage(const TiledMap& log_odds, nav_msgs::OccupancyGrid& map_msg)
+{
+    const CellBounds& bounds = log_odds.bounds();
+    if (bounds.empty())
+    {
+        map_msg.info.width = map_msg.info.height = 0;
+        map_msg.data.clear();
+        return;
+    }
+    map_msg.info.width = bounds.width();
+    map_msg.info.height = bounds.height();
+    map_msg.info.origin.position.x = bounds.min_x * map_msg.info.resolution;
+    map_msg.info.origin.position.y = bounds.min_y * map_msg.info.resolution;
+    map_msg.data.resize(map_msg.info.width * map_msg.info.height);
+    copyRegion(log_odds, bounds, map_msg.data.data());
+}
+
+/**
+ * @brief Заполнение сообщения с изменившимся участком карты
+ *
+ * Координаты участка отсчитываются от начала последней опубликованной полной карты
+ *
+ * @param bounds непустая область измененных ячеек
+ */
+void fillMapUpdateMessage(const TiledMap& log_odds,
+                          const CellBounds& map_bounds,
+                          const CellBounds& bounds,
+                          map_msgs::OccupancyGridUpdate& update_msg)
+{
+    update_msg.x = bounds.min_x - map_bounds.min_x;
+    update_msg.y = bounds.min_y - map_bounds.min_y;
+    update_msg.width = bounds.width();
+    update_msg.height = bounds.height();
+    update_msg.data.resize(update_msg.width * update_msg.height);
+    copyRegion(log_odds, bounds, update_msg.data.data());
+}
+
+// публикация полной карты всем подписчикам
+void publishFullMap(const TiledMap& map, MapOutput& output)
+{
+    fillMapMessage(map, output.msg);
+    output.published_bounds = map.bounds();
+    output.pub.publish(output.msg);
+}
+
+// публикация изменившегося участка карты
+void publishMapChanges(const TiledMap& map, MapOutput& output, const CellBounds& dirty)
+{
+    if (map.bounds() != output.published_bounds)
+    {
+        // карта выросла, участки изменений нельзя наложить на опубликованную карту
+        publishFullMap(map, output);
+        return;
+    }
+    if (dirty.empty())
+        return;
+    map_msgs::OccupancyGridUpdate update_msg;
+    update_msg.header = output.msg.header;
+    fillMapUpdateMessage(map, output.published_bounds, dirty, update_msg);
+    output.update_pub.publish(update_msg);
+}
+
+// новый подписчик сразу получает полную карту, дальше ему достаточно изменений
+void sendFullMap(const TiledMap& map, MapOutput& output, const ros::SingleSubscriberPublisher& subscriber)
+{
+    if (map.bounds() != output.published_bounds)
+    {
+        publishFullMap(map, output);
+        return;
+    }
+    fillMapMessage(map, output.msg);
+    subscriber.publish(output.msg);
+}
+
+// деление с округлением вниз, в том числе для отрицательных координат
+inline int floorHalf(int value)
+{
+    return value >= 0 ? value / 2 : -((1 - value) / 2);
+}
+
+// область ячеек следующего уровня пирамиды, содержащая область bounds
+CellBounds coarserBounds(const CellBounds& bounds)
+{
+    CellBounds result;
+    if (!bounds.empty())
+    {
+        result.add(floorHalf(bounds.min_x), floorHalf(bounds.min_y));
+        result.add(floorHalf(bounds.max_x), floorHalf(bounds.max_y));
+    }
+    return result;
+}
+
+/**
+ * @brief Пересчет области region уровня пирамиды coarse по предыдущему уровню fine
+ *
+ * Ячейка уровня получает максимум по известным ячейкам блока 2x2 предыдущего уровня,
+ * неизвестные ячейки не учитываются. Тайлы уровня создаются только над существующими тайлами fine.
+ */
+void downsampleRegion(const TiledMap& fine, TiledMap& coarse, const CellBounds& region)
+{
+    if (region.empty())
+        return;
+    const float unknown = -std::numeric_limits<float>::infinity();
+    for (int tile_y = TiledMap::tile_coord(region.min_y); tile_y <= TiledMap::tile_coord(region.max_y); ++tile_y)
+    {
+        for (int tile_x = TiledMap::tile_coord(region.min_x); tile_x <= TiledMap::tile_coord(region.max_x); ++tile_x)
         {
-            tf::Vector3 r_map = scanTransform(tf::Vector3(r * cos_a, r * sin_a, 0));
-            int r_y = (r_map.y() - map_msg.info.origin.position.y ) * inv_map_res;
-            int r_x = (r_map.x() - map_msg.info.origin.position.x ) * inv_map_res;
-            float p = 0.5;
-            if (abs(range - r) < 0.1)
-                p = 1.0;
-            else if (range - r > 0.1)
-                p = 0.0;
-
-            if(use_bayes)
+            // тайл уровня покрывает 2x2 тайла предыдущего уровня
+            const TiledMap::Tile* children[2][2];
+            bool any_child = false;
+            for (int j = 0; j < 2; ++j)
             {
-                // Bayes
-                float log_prev = log2p(float(map_msg.data[ r_y* map_width +r_x])/100);
-                float log_free = log2p(0.5);
-                float log_inv = log2p(p);
-                float log_ti = log_inv + log_prev - log_free;
-                map_msg.data[ r_y* map_width + r_x] = get_map(log_ti);
+                for (int i = 0; i < 2; ++i)
+                {
+                    children[j][i] = fine.find_tile(2 * tile_x + i, 2 * tile_y + j);
+                    any_child = any_child || children[j][i];
+                }
             }
-            else
+            if (!any_child)
+                continue;
+            TiledMap::Tile& tile = coarse.get_tile(tile_x, tile_y);
+
+            const int y_begin = std::max(region.min_y, tile_y * TILE_SIZE) - tile_y * TILE_SIZE;
+            const int y_end = std::min(region.max_y + 1, (tile_y + 1) * TILE_SIZE) - tile_y * TILE_SIZE;
+            const int x_begin = std::max(region.min_x, tile_x * TILE_SIZE) - tile_x * TILE_SIZE;
+            const int x_end = std::min(region.max_x + 1, (tile_x + 1) * TILE_SIZE) - tile_x * TILE_SIZE;
+            for (int y = y_begin; y < y_end; ++y)
             {
-                // Non-Bayes
-                map_msg.data[ r_y* map_width + r_x] = r > range ? 100: 0;
+                const TiledMap::Tile* const* row_children = children[2 * y / TILE_SIZE];
+                const int fine_row = (2 * y % TILE_SIZE) * TILE_SIZE;
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    const TiledMap::Tile* child = row_children[2 * x / TILE_SIZE];
+                    float value = 0;
+                    if (child)
+                    {
+                        const float* block = child->cells + fine_row + 2 * x % TILE_SIZE;
+                        value = unknown;
+                        for (int k : {0, 1, TILE_SIZE, TILE_SIZE + 1})
+                            value = std::max(value, block[k] == 0 ? unknown : block[k]);
+                        if (value == unknown)
+                            value = 0;
+                    }
+                    tile.cells[y * TILE_SIZE + x] = value;
+                }
             }
         }
     }
 }
 
+/**
+ * @brief Пересчет уровней пирамиды по измененной области исходной карты и публикация изменений
+ *
+ * @param dirty область ячеек исходной карты, измененных сканом
+ */
+void updatePyramid(const CellBounds& dirty, const ros::Time& stamp)
+{
+    const TiledMap* fine = &log_odds_map;
+    CellBounds region = dirty;
+    for (PyramidLevel& level : pyramid)
+    {
+        region = coarserBounds(region);
+        downsampleRegion(*fine, level.map, region);
+        level.output.msg.header.stamp = stamp;
+        publishMapChanges(level.map, level.output, region);
+        fine = &level.map;
+    }
+}
 
 /**
- * @brief Callback дальномера, в котором строится карта
+ * @brief Интеграция скана дальномера в карту и публикация изменений
  * 
- * @param scan сообщение со сканом дальномера
+ * @param scan сообщение со сканом дальномера, трансформ для которого уже доступен
  */
-void laserCallback(const sensor_msgs::LaserScan& scan)
+void integrateScan(Sensor& sensor, const sensor_msgs::LaserScan& scan)
 {
     tf::StampedTransform scanTransform;
     const std::string& laser_frame = scan.header.frame_id;
@@ -146,8 +426,24 @@ void laserCallback(const sensor_msgs::LaserScan& scan)
     if (!determineScanTransform(scanTransform, laser_stamp, laser_frame)) {
         return;
     }
+    // трансформ на момент последнего луча для компенсации движения за время скана
+    tf::StampedTransform scanEndTransform = scanTransform;
+    if (deskew && scan.time_increment != 0 && scan.ranges.size() > 1)
+    {
+        const ros::Time end_stamp = laser_stamp + ros::Duration(scan.time_increment * (scan.ranges.size() - 1));
+        if (!determineScanTransform(scanEndTransform, end_stamp, laser_frame, false))
+        {
+            ROS_WARN_STREAM_THROTTLE(1.0, "no transform for the end of scan, integrating without deskew");
+            scanEndTransform = scanTransform;
+        }
+    }
 
-    map_msg.header.stamp = laser_stamp;
+    // трассировка лучей не обращается к карте и выполняется без блокировки
+    sensor.integrator->trace(scan, scanTransform, scanEndTransform);
+
+    std::lock_guard<std::mutex> lock(map_mutex);
+
+    map_output.msg.header.stamp = laser_stamp;
 
     //положение центра дальномера в СК дальномера
     tf::Vector3 zero_pose(0, 0, 0);
@@ -156,17 +452,115 @@ void laserCallback(const sensor_msgs::LaserScan& scan)
     ROS_INFO_STREAM("scan pose "<<scan_pose.x()<<" "<<scan_pose.y());
 
     //индексы карты, соответствующие положению центра лазера
-    int y = (scan_pose.y() - map_msg.info.origin.position.y ) / map_resolution;
-    int x = (scan_pose.x() - map_msg.info.origin.position.x ) / map_resolution;
+    int y = std::floor(scan_pose.y() / map_resolution);
+    int x = std::floor(scan_pose.x() / map_resolution);
     ROS_INFO_STREAM("publish map "<<x<<" "<<y);
-    // в клетку карты записываем значение 100
-    map_msg.data[ y* map_width + x] = 0;
+    CellBounds dirty;
+    // клетку карты под лазером отмечаем свободной
+    log_odds_map.cell(x, y) = log_odds_min;
+    dirty.add(x, y);
 
     // Заполняем карту
-    create_map(scan, scanTransform, map_msg, USE_BAYES);
+    sensor.integrator->apply(log_odds_map, dirty);
+
+    // публикуем только изменившийся участок карты, полная карта публикуется по таймеру
+    publishMapChanges(log_odds_map, map_output, dirty);
+    updatePyramid(dirty, laser_stamp);
+}
+
+/**
+ * @brief Callback фильтра сообщений: трансформ для скана доступен
+ *
+ * Скан только ставится в очередь дальномера, интеграция выполняется в потоке integrationWorker
+ */
+void scanReadyCallback(Sensor& sensor, const sensor_msgs::LaserScanConstPtr& scan)
+{
+    {
+        std::lock_guard<std::mutex> lock(sensor.queue_mutex);
+        if (sensor.queue.size() >= static_cast<size_t>(scan_queue_size))
+        {
+            sensor.queue.pop_front();
+            ++scans_dropped_queue;
+            ROS_WARN_STREAM_THROTTLE(1.0, "integration queue of "<<sensor.topic<<" overflow, dropped "
+                                     <<scans_dropped_queue<<" scans");
+        }
+        sensor.queue.push_back(scan);
+    }
+    sensor.queue_cv.notify_one();
+}
+
+// Callback фильтра сообщений: трансформ для скана не появился, скан отброшен
+void scanDroppedCallback(const sensor_msgs::LaserScanConstPtr& scan,
+                         tf2_ros::FilterFailureReason reason)
+{
+    ++scans_dropped_tf;
+    ROS_WARN_STREAM_THROTTLE(1.0, "no transform to scan "<<scan->header.frame_id
+                             <<", dropped "<<scans_dropped_tf<<" scans of "
+                             <<scans_dropped_tf + scans_integrated + scans_dropped_queue);
+}
+
+// поток интеграции сканов дальномера из его очереди в карту
+void integrationWorker(Sensor& sensor)
+{
+    while (ros::ok())
+    {
+        sensor_msgs::LaserScanConstPtr scan;
+        {
+            std::unique_lock<std::mutex> lock(sensor.queue_mutex);
+            // ожидание с таймаутом, чтобы поток завершился вместе с ros
+            if (!sensor.queue_cv.wait_for(lock, std::chrono::milliseconds(100),
+                                          [&sensor] { return !sensor.queue.empty(); }))
+                continue;
+            scan = sensor.queue.front();
+            sensor.queue.pop_front();
+        }
+        integrateScan(sensor, *scan);
+        ++scans_integrated;
+    }
+}
 
-    // публикуем сообщение с построенной картой
-    mapPub.publish(map_msg);
+// публикация полной карты с низкой частотой
+void fullMapTimerCallback(const ros::TimerEvent&)
+{
+    std::lock_guard<std::mutex> lock(map_mutex);
+    if (map_output.pub.getNumSubscribers() > 0)
+        publishFullMap(log_odds_map, map_output);
+    for (PyramidLevel& level : pyramid)
+    {
+        if (level.output.pub.getNumSubscribers() > 0)
+            publishFullMap(level.map, level.output);
+    }
+}
+
+void mapConnectCallback(const ros::SingleSubscriberPublisher& subscriber)
+{
+    std::lock_guard<std::mutex> lock(map_mutex);
+    sendFullMap(log_odds_map, map_output, subscriber);
+}
+
+// сервис сохранения карты в файл map_file
+bool saveMapService(std_srvs::Trigger::Request&, std_srvs::Trigger::Response& response)
+{
+    std::string error;
+    ros::WallTime start = ros::WallTime::now();
+    size_t tiles = 0;
+    {
+        std::lock_guard<std::mutex> lock(map_mutex);
+        response.success = save_map(log_odds_map, map_resolution, map_file, map_compression, error);
+        tiles = log_odds_map.tile_count();
+    }
+    if (!response.success)
+    {
+        ROS_ERROR_STREAM("failed to save map: "<<error);
+        response.message = error;
+        return true;
+    }
+    std::stringstream stream;
+    stream<<"saved "<<tiles<<" tiles to "<<map_file
+          <<" in "<<(ros::WallTime::now() - start).toSec()<<" s";
+    response.message = stream.str();
+    ROS_INFO_STREAM(response.message);
+    return true;
 }
 
 int main(int argc, char **argv)
@@ -188,30 +582,153 @@ int main(int argc, char **argv)
   //читаем параметры
   map_frame = node.param<std::string>("map_frame", "odom");
   map_resolution = node.param("map_resolution", map_resolution);
-  map_width = node.param("map_width", map_width);
-  map_height = node.param("map_height", map_height);
-
-  //создание объекта tf Listener
-  tfListener = new tf::TransformListener;
-
-  // Подписываемся на данные дальномера
-  ros::Subscriber laser_sub = node.subscribe("/scan", 100, laserCallback);  
+  USE_BAYES = node.param("use_bayes", USE_BAYES);
+  //per_beam - ячейка обновляется каждым прошедшим через нее лучом, per_cell - один раз за скан
+  const std::string mode = node.param<std::string>("integration_mode", "per_beam");
+  if (mode == "per_cell")
+    integration_mode = IntegrationMode::PerCell;
+  else if (mode != "per_beam")
+    ROS_WARN_STREAM("unknown integration_mode "<<mode<<", using per_beam");
+  p_hit = node.param("p_hit", p_hit);
+  p_miss = node.param("p_miss", p_miss);
+  log_odds_min = node.param("log_odds_min", log_odds_min);
+  log_odds_max = node.param("log_odds_max", log_odds_max);
+  //затухание карты для меняющегося окружения, с (0 - без затухания)
+  decay_time = node.param("decay_time", decay_time);
+  full_map_rate = node.param("full_map_rate", full_map_rate);
+  pyramid_levels = node.param("pyramid_levels", pyramid_levels);
+  map_file = node.param("map_file", map_file);
+  map_compression = node.param("map_compression", map_compression);
+  //файл карты, поверх которой продолжается построение (пусто - начать с пустой карты)
+  std::string load_map_file = node.param<std::string>("load_map_file", "");
+  scan_queue_size = node.param("scan_queue_size", scan_queue_size);
+  deskew = node.param("deskew", deskew);
+  scan_duration = node.param("scan_duration", scan_duration);
+  //сколько сканов фильтр хранит в ожидании трансформа
+  int tf_filter_queue_size = node.param("tf_filter_queue_size", 100);
+  integration_threads = node.param("integration_threads", integration_threads);
+  if (integration_threads <= 0)
+    integration_threads = std::max(1u, std::thread::hardware_concurrency());
+  //топики сканов всех дальномеров, строящих общую карту
+  std::vector<std::string> scan_topics{"/scan"};
+  node.getParam("scan_topics", scan_topics);
+
+  //создание буфера трансформов и заполняющего его tf Listener
+  tfBuffer = new tf2_ros::Buffer;
+  tf2_ros::TransformListener tfListener(*tfBuffer);
+
+  // Подписываемся на данные дальномеров через фильтры, которые придерживают сканы,
+  // пока не станет доступен трансформ в СК карты, и не блокируют поток ros::spin
+  std::vector<std::unique_ptr<message_filters::Subscriber<sensor_msgs::LaserScan>>> laser_subs;
+  std::vector<std::unique_ptr<tf2_ros::MessageFilter<sensor_msgs::LaserScan>>> laser_filters;
+  //потоки интеграции делятся между дальномерами
+  const int sensor_threads = std::max<int>(1, integration_threads / std::max<size_t>(1, scan_topics.size()));
+  for (const std::string& topic : scan_topics)
+  {
+    sensors.emplace_back(new Sensor);
+    Sensor* sensor = sensors.back().get();
+    sensor->topic = topic;
+    sensor->pool.reset(new simple_map::ThreadPool(sensor_threads));
+
+    laser_subs.emplace_back(new message_filters::Subscriber<sensor_msgs::LaserScan>(node, topic, 100));
+    laser_filters.emplace_back(new tf2_ros::MessageFilter<sensor_msgs::LaserScan>(
+        *laser_subs.back(), *tfBuffer, map_frame, tf_filter_queue_size, node));
+    tf2_ros::MessageFilter<sensor_msgs::LaserScan>& laser_filter = *laser_filters.back();
+    if (deskew)
+    {
+      // скан передается на интеграцию, когда доступен трансформ и на момент его последнего луча
+      laser_filter.setTolerance(ros::Duration(scan_duration));
+    }
+    laser_filter.registerCallback([sensor](const sensor_msgs::LaserScanConstPtr& scan)
+                                  {
+                                    scanReadyCallback(*sensor, scan);
+                                  });
+    laser_filter.registerFailureCallback(scanDroppedCallback);
+  }
 
   //объявляем публикацию сообщений карты
   //Используем глобальную переменную, так как она понядобится нам внутр функции - обработчика данных лазера
 
-  mapPub = node.advertise<nav_msgs::OccupancyGrid>("/simple_map", 10);
+  map_output.pub = node.advertise<nav_msgs::OccupancyGrid>("/simple_map", 10, mapConnectCallback);
+  //изменения карты публикуются в топик с суффиксом _updates, на который подписывается rviz
+  map_output.update_pub = node.advertise<map_msgs::OccupancyGridUpdate>("/simple_map_updates", 10);
 
   //заполняем информацию о карте - готовим сообщение
-  prepareMapMessage(map_msg);
+  prepareMapMessage(map_output.msg, map_resolution);
+  prepareProbabilityLut();
+
+  if (!load_map_file.empty())
+  {
+    std::string error;
+    double loaded_resolution = map_resolution;
+    if (load_map(load_map_file, log_odds_min, log_odds_max, log_odds_map, loaded_resolution, error))
+    {
+      if (loaded_resolution != map_resolution)
+      {
+        ROS_WARN_STREAM("map resolution "<<map_resolution<<" replaced by resolution of loaded map "<<loaded_resolution);
+        map_resolution = loaded_resolution;
+        map_output.msg.info.resolution = map_resolution;
+      }
+      ROS_INFO_STREAM("loaded "<<log_odds_map.tile_count()<<" tiles from "<<load_map_file);
+    }
+    else
+    {
+      ROS_ERROR_STREAM("failed to load map: "<<error<<", starting with an empty map");
+    }
+  }
+
+  IntegrationParams integration_params;
+  integration_params.resolution = map_resolution;
+  integration_params.use_bayes = USE_BAYES;
+  integration_params.mode = integration_mode;
+  integration_params.log_odds_hit = log_odds_hit;
+  integration_params.log_odds_miss = log_odds_miss;
+  integration_params.log_odds_min = log_odds_min;
+  integration_params.log_odds_max = log_odds_max;
+  integration_params.decay_time = decay_time;
+  for (auto& sensor : sensors)
+    sensor->integrator.reset(new MapIntegrator(*sensor->pool, integration_params));
+
+  //уровни пирамиды публикуются в топики /simple_map_2x, /simple_map_4x ...
+  //вектор заполняется до начала работы потоков и больше не меняет размер
+  pyramid.resize(std::max(0, pyramid_levels));
+  for (size_t i = 0; i < pyramid.size(); ++i)
+  {
+    PyramidLevel& level = pyramid[i];
+    level.scale = 2 << i;
+    const std::string topic = "/simple_map_" + std::to_string(level.scale) + "x";
+    level.output.pub = node.advertise<nav_msgs::OccupancyGrid>(topic, 1,
+        [i](const ros::SingleSubscriberPublisher& subscriber)
+        {
+          std::lock_guard<std::mutex> lock(map_mutex);
+          sendFullMap(pyramid[i].map, pyramid[i].output, subscriber);
+        });
+    level.output.update_pub = node.advertise<map_msgs::OccupancyGridUpdate>(topic + "_updates", 10);
+    prepareMapMessage(level.output.msg, map_resolution * level.scale);
+  }
+  //пирамида загруженной карты строится целиком
+  updatePyramid(log_odds_map.bounds(), ros::Time::now());
+
+  ros::ServiceServer save_map_service = node.advertiseService("save_map", saveMapService);
+
+  ros::Timer full_map_timer;
+  if (full_map_rate > 0)
+    full_map_timer = node.createTimer(ros::Duration(1.0 / full_map_rate), fullMapTimerCallback);
+  //интеграция сканов каждого дальномера выполняется в отдельном потоке
+  for (auto& sensor : sensors)
+    sensor->worker = std::thread(integrationWorker, std::ref(*sensor));
    /**
    * ros::spin() функция внутри которой происходит вся работа по приему сообщений
-   * и вызову соответствующих обработчиков . Вся обработка происходит из основного потока
-   * (того, который вызвал ros::spin(), то есть основного в данном случае)
+   * и вызову соответствующих обработчиков . Прием сканов и публикация полной карты выполняются
+   * в основном потоке, интеграция сканов в карту - в потоках дальномеров
    * Функция будет завершена, когда подьзователь прервет выполнение процесса с Ctrl-C
    *
    */
   ros::spin();
+  for (auto& sensor : sensors)
+    sensor->worker.join();
+  ROS_INFO_STREAM("scans integrated "<<scans_integrated<<", dropped without transform "<<scans_dropped_tf
+                  <<", dropped on queue overflow "<<scans_dropped_queue);
 
   return 0;
 }
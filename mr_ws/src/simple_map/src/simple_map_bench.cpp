@@ -0,0 +1,393 @@
+// Замер производительности интеграции сканов в карту без запуска stage и ROS.
+// Сканы либо моделируются трассировкой лучей по картинке мира stage вдоль траектории робота,
+// либо читаются из файла, записанного ранее с ключом --record.
+//
+// Пример (мир mapping.world):
+//   simple_map_bench --bitmap stage_worlds/bitmaps/mapping_map.png --size 80 120 --center 0 50
+#include <png.h>
+#include <sensor_msgs/LaserScan.h>
+#include <tf/transform_datatypes.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <simple_map/thread_pool.h>
+
+#include "map_integrator.h"
+#include "tiled_map.h"
+
+// положение дальномера на плоскости
+struct Pose
+{
+    double x;
+    double y;
+    double yaw;
+};
+
+/**
+ * @brief Мир stage: картинка с препятствиями, растянутая на прямоугольник size_x x size_y
+ *
+ * Как и в stage, темные пиксели считаются препятствиями, за пределами картинки препятствий нет.
+ */
+struct StageWorld
+{
+    // 1 - препятствие, строки картинки сверху вниз
+    std::vector<uint8_t> occupied;
+    int width = 0;
+    int height = 0;
+    // размер и положение центра картинки в мире, м
+    double size_x = 0;
+    double size_y = 0;
+    double center_x = 0;
+    double center_y = 0;
+
+    bool load(const std::string& path, std::string& error)
+    {
+        png_image image;
+        std::memset(&image, 0, sizeof(image));
+        image.version = PNG_IMAGE_VERSION;
+        if (!png_image_begin_read_from_file(&image, path.c_str()))
+        {
+            error = image.message;
+            return false;
+        }
+        image.format = PNG_FORMAT_GRAY;
+        std::vector<uint8_t> pixels(PNG_IMAGE_SIZE(image));
+        if (!png_image_finish_read(&image, nullptr, pixels.data(), 0, nullptr))
+        {
+            error = image.message;
+            png_image_free(&image);
+            return false;
+        }
+        width = image.width;
+        height = image.height;
+        occupied.resize(pixels.size());
+        for (size_t i = 0; i < pixels.size(); ++i)
+            occupied[i] = pixels[i] < 128;
+        return true;
+    }
+
+    bool is_occupied(int u, int v) const
+    {
+        return u >= 0 && v >= 0 && u < width && v < height && occupied[v * width + u];
+    }
+
+    /**
+     * @brief Дальность до ближайшего препятствия из точки (x, y) в направлении angle
+     *
+     * @return max_range, если препятствия на луче нет
+     */
+    float cast(double x, double y, double angle, double max_range) const
+    {
+        // пиксели картинки могут быть неквадратными, поэтому трассируем в координатах картинки
+        const double scale_u = width / size_x;
+        const double scale_v = height / size_y;
+        const double left = center_x - size_x / 2;
+        const double top = center_y + size_y / 2;
+        const double dir_x = std::cos(angle);
+        const double dir_y = std::sin(angle);
+        float range = max_range;
+        trace_ray((x - left) * scale_u, (top - y) * scale_v,
+                  (x + max_range * dir_x - left) * scale_u, (top - y - max_range * dir_y) * scale_v,
+                  [&](int u, int v, bool) -> bool
+                  {
+                      if (!is_occupied(u, v))
+                          return true;
+                      // дальность до центра пикселя вдоль луча
+                      const double hit_x = left + (u + 0.5) / scale_u;
+                      const double hit_y = top - (v + 0.5) / scale_v;
+                      range = std::max(0.0, (hit_x - x) * dir_x + (hit_y - y) * dir_y);
+                      return false;
+                  });
+        return range;
+    }
+};
+
+/**
+ * @brief Набор сканов с одинаковой геометрией и положениями дальномера в СК карты
+ *
+ * Формат файла: заголовок ScanLogHeader, затем положения всех сканов (3 double на скан),
+ * затем дальности всех сканов (beams float на скан).
+ */
+struct ScanLog
+{
+    float angle_min = -M_PI_2;
+    float angle_increment = M_PI / 180;
+    float range_min = 0;
+    float range_max = 50;
+    uint32_t beams = 0;
+    std::vector<Pose> poses;
+    // дальности всех сканов подряд
+    std::vector<float> ranges;
+};
+
+const char SCAN_LOG_MAGIC[4] = {'S', 'S', 'C', 'N'};
+const uint32_t SCAN_LOG_VERSION = 1;
+
+struct ScanLogHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t beams;
+    uint32_t scans;
+    float angle_min;
+    float angle_increment;
+    float range_min;
+    float range_max;
+};
+
+bool save_scans(const ScanLog& log, const std::string& path, std::string& error)
+{
+    std::ofstream file(path, std::ios::binary);
+    ScanLogHeader header;
+    std::memcpy(header.magic, SCAN_LOG_MAGIC, sizeof(header.magic));
+    header.version = SCAN_LOG_VERSION;
+    header.beams = log.beams;
+    header.scans = log.poses.size();
+    header.angle_min = log.angle_min;
+    header.angle_increment = log.angle_increment;
+    header.range_min = log.range_min;
+    header.range_max = log.range_max;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(log.poses.data()), log.poses.size() * sizeof(Pose));
+    file.write(reinterpret_cast<const char*>(log.ranges.data()), log.ranges.size() * sizeof(float));
+    if (!file)
+    {
+        error = "can't write " + path;
+        return false;
+    }
+    return true;
+}
+
+bool load_scans(const std::string& path, ScanLog& log, std::string& error)
+{
+    std::ifstream file(path, std::ios::binary);
+    ScanLogHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, SCAN_LOG_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error = path + " is not a scan file";
+        return false;
+    }
+    if (header.version != SCAN_LOG_VERSION)
+    {
+        error = "unsupported scan file version " + std::to_string(header.version);
+        return false;
+    }
+    log.beams = header.beams;
+    log.angle_min = header.angle_min;
+    log.angle_increment = header.angle_increment;
+    log.range_min = header.range_min;
+    log.range_max = header.range_max;
+    log.poses.resize(header.scans);
+    log.ranges.resize(static_cast<size_t>(header.scans) * header.beams);
+    file.read(reinterpret_cast<char*>(log.poses.data()), log.poses.size() * sizeof(Pose));
+    file.read(reinterpret_cast<char*>(log.ranges.data()), log.ranges.size() * sizeof(float));
+    if (!file)
+    {
+        error = path + " is truncated";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Моделирование сканов вдоль траектории робота в мире stage
+ *
+ * Робот едет прямо с шагом step, а перед препятствием поворачивает на случайный угол.
+ * Скан снимается в каждой точке траектории, движение за время скана не моделируется.
+ */
+void simulate_scans(const StageWorld& world, Pose pose, size_t scans, double step, ScanLog& log)
+{
+    // минимальное расстояние до препятствия по ходу движения, м
+    const double clearance = 1.0;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> turn(M_PI_2, 3 * M_PI_2);
+
+    log.poses.clear();
+    log.ranges.clear();
+    for (size_t scan = 0; scan < scans; ++scan)
+    {
+        log.poses.push_back(pose);
+        for (uint32_t i = 0; i < log.beams; ++i)
+        {
+            const double angle = pose.yaw + log.angle_min + i * log.angle_increment;
+            log.ranges.push_back(world.cast(pose.x, pose.y, angle, log.range_max));
+        }
+
+        for (int attempt = 0; attempt < 16; ++attempt)
+        {
+            if (world.cast(pose.x, pose.y, pose.yaw, clearance + step) >= clearance + step)
+            {
+                pose.x += step * std::cos(pose.yaw);
+                pose.y += step * std::sin(pose.yaw);
+                break;
+            }
+            pose.yaw = std::remainder(pose.yaw + turn(rng), 2 * M_PI);
+        }
+    }
+}
+
+/**
+ * @brief Интеграция всех сканов в пустую карту
+ *
+ * @return время интеграции, с
+ */
+double run_integration(const ScanLog& log, MapIntegrator& integrator, TiledMap& map)
+{
+    sensor_msgs::LaserScan scan;
+    scan.angle_min = log.angle_min;
+    scan.angle_increment = log.angle_increment;
+    scan.angle_max = log.angle_min + log.angle_increment * (log.beams - 1);
+    scan.range_min = log.range_min;
+    scan.range_max = log.range_max;
+    scan.ranges.resize(log.beams);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < log.poses.size(); ++i)
+    {
+        std::copy_n(log.ranges.begin() + i * log.beams, log.beams, scan.ranges.begin());
+        // сканы идут с частотой 10 Гц, время нужно для затухания карты
+        scan.header.stamp = ros::Time(1.0 + i * 0.1);
+        tf::Transform transform(tf::createQuaternionFromYaw(log.poses[i].yaw),
+                                tf::Vector3(log.poses[i].x, log.poses[i].y, 0));
+        CellBounds dirty;
+        integrator.integrate(scan, transform, transform, map, dirty);
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void print_usage()
+{
+    std::cerr << "usage: simple_map_bench (--bitmap <png> --size <x> <y> | --replay <file>) [options]\n"
+              << "  --center <x> <y>    center of the stage bitmap in the world, m (0 0)\n"
+              << "  --start <x> <y>     start position of the robot, m (0 0)\n"
+              << "  --scans <n>         number of simulated scans (1000)\n"
+              << "  --beams <n>         beams per scan (180)\n"
+              << "  --fov <deg>         scan field of view (180)\n"
+              << "  --range <m>         maximum range (50)\n"
+              << "  --step <m>          distance between scans (0.2)\n"
+              << "  --record <file>     save simulated scans for later replay\n"
+              << "  --resolution <m>    map resolution (0.1)\n"
+              << "  --decay <s>         log-odds decay time, 0 - no decay (0)\n"
+              << "  --threads <n>       integration threads, 0 - number of cores (0)\n";
+}
+
+int main(int argc, char **argv)
+{
+    std::string bitmap, replay, record;
+    StageWorld world;
+    Pose start{0, 0, 0};
+    size_t scans = 1000;
+    int beams = 180;
+    double fov = 180;
+    double range = 50;
+    double step = 0.2;
+    double resolution = 0.1;
+    double decay_time = 0;
+    int threads = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        // число значений, которые должны следовать за ключом
+        const int values = (arg == "--size" || arg == "--center" || arg == "--start") ? 2 : 1;
+        if (i + values >= argc)
+        {
+            print_usage();
+            return 1;
+        }
+        if (arg == "--bitmap") bitmap = argv[++i];
+        else if (arg == "--replay") replay = argv[++i];
+        else if (arg == "--record") record = argv[++i];
+        else if (arg == "--size") { world.size_x = std::stod(argv[++i]); world.size_y = std::stod(argv[++i]); }
+        else if (arg == "--center") { world.center_x = std::stod(argv[++i]); world.center_y = std::stod(argv[++i]); }
+        else if (arg == "--start") { start.x = std::stod(argv[++i]); start.y = std::stod(argv[++i]); }
+        else if (arg == "--scans") scans = std::stoul(argv[++i]);
+        else if (arg == "--beams") beams = std::stoi(argv[++i]);
+        else if (arg == "--fov") fov = std::stod(argv[++i]);
+        else if (arg == "--range") range = std::stod(argv[++i]);
+        else if (arg == "--step") step = std::stod(argv[++i]);
+        else if (arg == "--resolution") resolution = std::stod(argv[++i]);
+        else if (arg == "--decay") decay_time = std::stod(argv[++i]);
+        else if (arg == "--threads") threads = std::stoi(argv[++i]);
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    ScanLog log;
+    std::string error;
+    if (!replay.empty())
+    {
+        if (!load_scans(replay, log, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+    else if (!bitmap.empty() && world.size_x > 0 && world.size_y > 0 && beams > 1)
+    {
+        if (!world.load(bitmap, error))
+        {
+            std::cerr << "failed to load " << bitmap << ": " << error << std::endl;
+            return 1;
+        }
+        log.beams = beams;
+        log.angle_increment = fov * M_PI / 180 / (beams - 1);
+        log.angle_min = -fov * M_PI / 360;
+        log.range_max = range;
+        simulate_scans(world, start, scans, step, log);
+        if (!record.empty() && !save_scans(log, record, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    simple_map::ThreadPool pool(threads);
+
+    IntegrationParams params;
+    params.resolution = resolution;
+    params.decay_time = decay_time;
+    params.log_odds_hit = std::log(0.7 / 0.3);
+    params.log_odds_miss = std::log(0.4 / 0.6);
+
+    const size_t total_beams = log.poses.size() * log.beams;
+    std::cout << log.poses.size() << " scans, " << log.beams << " beams, " << threads << " threads" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    const std::pair<const char*, IntegrationMode> modes[] = {
+        {"per_beam", IntegrationMode::PerBeam},
+        {"per_cell", IntegrationMode::PerCell}
+    };
+    for (const auto& mode : modes)
+    {
+        params.mode = mode.second;
+        MapIntegrator integrator(pool, params);
+        TiledMap map;
+        const double seconds = run_integration(log, integrator, map);
+        std::cout << std::setw(9) << mode.first << ": "
+                  << log.poses.size() / seconds << " scans/s, "
+                  << total_beams / seconds << " beams/s, "
+                  << map.tile_count() << " tiles" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include "tiled_map.h"
+
+TiledMap::Tile& TiledMap::get_tile(int tile_x, int tile_y)
+{
+  std::unique_ptr<Tile>& tile = tiles[tile_key(tile_x, tile_y)];
+  if (!tile) {
+    tile.reset(new Tile);
+    cell_bounds.add(tile_x * TILE_SIZE, tile_y * TILE_SIZE);
+    cell_bounds.add((tile_x + 1) * TILE_SIZE - 1, (tile_y + 1) * TILE_SIZE - 1);
+  }
+  return *tile;
+}
+
+TiledMap::Tile* TiledMap::find_tile(int tile_x, int tile_y)
+{
+  auto it = tiles.find(tile_key(tile_x, tile_y));
+  return it == tiles.end() ? nullptr : it->second.get();
+}
+
+const TiledMap::Tile* TiledMap::find_tile(int tile_x, int tile_y) const
+{
+  auto it = tiles.find(tile_key(tile_x, tile_y));
+  return it == tiles.end() ? nullptr : it->second.get();
+}
+
+float TiledMap::value(int x, int y) const
+{
+  const Tile* tile = find_tile(tile_coord(x), tile_coord(y));
+  return tile ? tile->cells[cell_index(x, y)] : 0.0f;
+}
+
+void TiledMap::clear()
+{
+  tiles.clear();
+  cell_bounds = CellBounds();
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+// размер стороны тайла карты: 2^TILE_SIZE_BITS ячеек
+const int TILE_SIZE_BITS = 6;
+const int TILE_SIZE = 1 << TILE_SIZE_BITS;
+
+// прямоугольная область ячеек карты (границы включительно)
+struct CellBounds
+{
+  int min_x = std::numeric_limits<int>::max();
+  int min_y = std::numeric_limits<int>::max();
+  int max_x = std::numeric_limits<int>::min();
+  int max_y = std::numeric_limits<int>::min();
+
+  bool empty() const { return min_x > max_x; }
+  int width() const { return max_x - min_x + 1; }
+  int height() const { return max_y - min_y + 1; }
+  void add(int x, int y)
+  {
+    min_x = std::min(min_x, x);
+    min_y = std::min(min_y, y);
+    max_x = std::max(max_x, x);
+    max_y = std::max(max_y, y);
+  }
+  void add(const CellBounds& other)
+  {
+    if (other.empty())
+      return;
+    add(other.min_x, other.min_y);
+    add(other.max_x, other.max_y);
+  }
+  bool operator==(const CellBounds& other) const
+  {
+    return min_x == other.min_x && min_y == other.min_y &&
+           max_x == other.max_x && max_y == other.max_y;
+  }
+  bool operator!=(const CellBounds& other) const { return !(*this == other); }
+};
+
+/**
+ * @brief Карта логарифмов отношения шансов, разбитая на тайлы TILE_SIZE x TILE_SIZE
+ *
+ * Тайлы создаются только при первом обращении к их ячейкам, поэтому карта может расти
+ * в любом направлении, а память пропорциональна исследованной области.
+ * Ячейки адресуются целыми координатами x, y (номер ячейки от начала СК карты),
+ * значение 0 соответствует неизвестной ячейке.
+ */
+class TiledMap
+{
+public:
+  struct Tile
+  {
+    float cells[TILE_SIZE * TILE_SIZE] = {};
+    // время последнего затухания значений тайла, с (0 - тайл еще не затухал)
+    double stamp = 0;
+  };
+
+  // номер тайла, в котором лежит ячейка с координатой cell (округление вниз и для отрицательных)
+  static int tile_coord(int cell) { return cell >= 0 ? cell >> TILE_SIZE_BITS : ~(~cell >> TILE_SIZE_BITS); }
+  // координата ячейки внутри тайла
+  static int cell_offset(int cell) { return cell - tile_coord(cell) * TILE_SIZE; }
+  // индекс ячейки в массиве тайла
+  static int cell_index(int x, int y) { return cell_offset(y) * TILE_SIZE + cell_offset(x); }
+
+  // возвращает тайл, создавая его при необходимости
+  Tile& get_tile(int tile_x, int tile_y);
+  // возвращает тайл или nullptr, если тайл еще не создан; безопасна для параллельного вызова
+  Tile* find_tile(int tile_x, int tile_y);
+  const Tile* find_tile(int tile_x, int tile_y) const;
+
+  // ссылка на значение ячейки, тайл создается при необходимости
+  float& cell(int x, int y) { return get_tile(tile_coord(x), tile_coord(y)).cells[cell_index(x, y)]; }
+  // значение ячейки, 0 для ячеек несозданных тайлов
+  float value(int x, int y) const;
+
+  // вызывает visit(tile_x, tile_y, tile) для всех созданных тайлов
+  template <typename TileVisitor>
+  void for_each_tile(TileVisitor visit) const
+  {
+    for (const auto& item : tiles) {
+      visit(static_cast<std::int32_t>(item.first >> 32),
+            static_cast<std::int32_t>(item.first & 0xffffffffu),
+            *item.second);
+    }
+  }
+
+  // область ячеек, покрытая созданными тайлами
+  const CellBounds& bounds() const { return cell_bounds; }
+  std::size_t tile_count() const { return tiles.size(); }
+  void clear();
+
+  // ключ тайла в хеш-таблице, годится и для данных, хранимых параллельно тайлам карты
+  static std::uint64_t tile_key(int tile_x, int tile_y)
+  {
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(tile_x)) << 32) |
+           static_cast<std::uint32_t>(tile_y);
+  }
+
+private:
+  std::unordered_map<std::uint64_t, std::unique_ptr<Tile>> tiles;
+  CellBounds cell_bounds;
+};
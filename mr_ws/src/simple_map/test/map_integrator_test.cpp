@@ -0,0 +1,133 @@
+/*
+ * map_integrator_test.cpp
+ *
+ * Тест интеграции сканов в карту без запуска ROS. Проверяется, что лучи с дальностью
+ * NaN и +-бесконечность (допустимы по REP 117) не меняют карту, и что область изменений
+ * скана, по которой публикуются патчи карты, покрывает ячейки, измененные затуханием.
+ */
+
+#include <sensor_msgs/LaserScan.h>
+#include <tf/transform_datatypes.h>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+#include <simple_map/thread_pool.h>
+
+#include "../src/map_integrator.h"
+#include "../src/tiled_map.h"
+
+namespace
+{
+
+IntegrationParams make_params()
+{
+  IntegrationParams params;
+  params.log_odds_hit = 0.85f;
+  params.log_odds_miss = -0.4f;
+  return params;
+}
+
+sensor_msgs::LaserScan make_scan(double stamp, std::size_t beams, float range)
+{
+  sensor_msgs::LaserScan scan;
+  scan.header.stamp = ros::Time(stamp);
+  scan.angle_min = -1.0f;
+  scan.angle_increment = 2.0f / (beams - 1);
+  scan.angle_max = scan.angle_min + scan.angle_increment * (beams - 1);
+  scan.range_min = 0.1f;
+  scan.range_max = 10.0f;
+  scan.ranges.assign(beams, range);
+  return scan;
+}
+
+const tf::Transform IDENTITY(tf::Quaternion(0, 0, 0, 1), tf::Vector3(0, 0, 0));
+
+// значения всех ячеек созданных тайлов
+std::vector<float> snapshot(const TiledMap& map)
+{
+  std::vector<float> cells;
+  map.for_each_tile([&](int, int, const TiledMap::Tile& tile)
+  {
+    cells.insert(cells.end(), std::begin(tile.cells), std::end(tile.cells));
+  });
+  return cells;
+}
+
+bool check_invalid_ranges()
+{
+  simple_map::ThreadPool pool(2);
+  MapIntegrator integrator(pool, make_params());
+  TiledMap map;
+  CellBounds dirty;
+  integrator.integrate(make_scan(1.0, 30, 5.0f), IDENTITY, IDENTITY, map, dirty);
+  const std::size_t tiles = map.tile_count();
+  const std::vector<float> before = snapshot(map);
+
+  sensor_msgs::LaserScan scan = make_scan(2.0, 30, 0);
+  const float values[] = {std::numeric_limits<float>::quiet_NaN(),
+                          std::numeric_limits<float>::infinity(),
+                          -std::numeric_limits<float>::infinity()};
+  for (std::size_t i = 0; i < scan.ranges.size(); ++i)
+    scan.ranges[i] = values[i % 3];
+  dirty = CellBounds();
+  integrator.integrate(scan, IDENTITY, IDENTITY, map, dirty);
+  return tiles > 0 && map.tile_count() == tiles && snapshot(map) == before && dirty.empty();
+}
+
+bool check_decay_dirty()
+{
+  simple_map::ThreadPool pool(2);
+  IntegrationParams params = make_params();
+  params.decay_time = 1.0;
+  MapIntegrator integrator(pool, params);
+  TiledMap map;
+  CellBounds dirty;
+  integrator.integrate(make_scan(1.0, 30, 5.0f), IDENTITY, IDENTITY, map, dirty);
+  const CellBounds bounds = map.bounds();
+  std::vector<float> before;
+  for (int y = bounds.min_y; y <= bounds.max_y; ++y)
+    for (int x = bounds.min_x; x <= bounds.max_x; ++x)
+      before.push_back(map.value(x, y));
+
+  // второй скан - один короткий луч, затухание меняет ячейки далеко от него
+  sensor_msgs::LaserScan scan = make_scan(2.0, 30, std::numeric_limits<float>::quiet_NaN());
+  scan.ranges[15] = 1.0f;
+  dirty = CellBounds();
+  integrator.integrate(scan, IDENTITY, IDENTITY, map, dirty);
+  if (map.bounds() != bounds)
+    return false;
+  std::size_t changed = 0;
+  std::size_t index = 0;
+  for (int y = bounds.min_y; y <= bounds.max_y; ++y)
+  {
+    for (int x = bounds.min_x; x <= bounds.max_x; ++x, ++index)
+    {
+      if (map.value(x, y) == before[index])
+        continue;
+      ++changed;
+      if (x < dirty.min_x || x > dirty.max_x || y < dirty.min_y || y > dirty.max_y)
+        return false;
+    }
+  }
+  return changed > 0;
+}
+
+}
+
+int main()
+{
+  bool ok = true;
+  if (!check_invalid_ranges())
+  {
+    std::cout << "FAIL: NaN or infinite ranges changed the map" << std::endl;
+    ok = false;
+  }
+  if (!check_decay_dirty())
+  {
+    std::cout << "FAIL: changed region misses cells changed by decay" << std::endl;
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
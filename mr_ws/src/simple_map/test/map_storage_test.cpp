@@ -0,0 +1,66 @@
+/*
+ * map_storage_test.cpp
+ *
+ * Тест сохранения и загрузки карты. Проверяется, что карта переживает сохранение
+ * со сжатием и без, а значения вне текущих границ логарифма отношения шансов
+ * (карта сохранена с другими границами или испорчена) ограничиваются при загрузке.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include "../src/map_storage.h"
+#include "../src/tiled_map.h"
+
+namespace
+{
+
+const float LOG_ODDS_MIN = -2.0f;
+const float LOG_ODDS_MAX = 3.5f;
+
+bool check_round_trip(bool compress)
+{
+  TiledMap map;
+  map.cell(3, 4) = 1.0f;
+  map.cell(-70, 5) = 10.0f;
+  map.cell(100, -1) = -10.0f;
+  map.cell(5, 5) = std::numeric_limits<float>::quiet_NaN();
+  map.cell(6, 5) = std::numeric_limits<float>::infinity();
+
+  const std::string path = "map_storage_test.map";
+  std::string error;
+  if (!save_map(map, 0.05, path, compress, error))
+  {
+    std::cout << error << std::endl;
+    return false;
+  }
+  TiledMap loaded;
+  double resolution = 0;
+  const bool ok = load_map(path, LOG_ODDS_MIN, LOG_ODDS_MAX, loaded, resolution, error);
+  std::remove(path.c_str());
+  if (!ok)
+  {
+    std::cout << error << std::endl;
+    return false;
+  }
+  return resolution == 0.05 && loaded.tile_count() == map.tile_count() &&
+         loaded.value(3, 4) == 1.0f && loaded.value(0, 0) == 0.0f &&
+         loaded.value(-70, 5) == LOG_ODDS_MAX && loaded.value(100, -1) == LOG_ODDS_MIN &&
+         loaded.value(5, 5) == 0.0f && loaded.value(6, 5) == LOG_ODDS_MAX;
+}
+
+}
+
+int main()
+{
+  bool ok = true;
+  if (!check_round_trip(false) || !check_round_trip(true))
+  {
+    std::cout << "FAIL: loaded map values are outside the log-odds bounds" << std::endl;
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}